@@ -0,0 +1,11 @@
+#!/bin/sh
+# usage: bench/globals.sh n [file]
+# Prints n dummy global defs followed by 'file', to time
+# lookups as the global env grows.
+i=0
+while [ $i -lt "$1" ]; do
+  echo "(def {g$i} $i)"
+  i=$((i + 1))
+done
+[ -n "$2" ] && cat "$2"
+exit 0
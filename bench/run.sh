@@ -0,0 +1,19 @@
+#!/bin/sh
+# usage: bench/run.sh [-n runs] "lisb [flags]" file...
+# Prints the best wall-clock time of each file over 'runs'
+# runs (default 5), in ms.
+runs=5
+if [ "$1" = "-n" ]; then runs=$2; shift 2; fi
+lisb=$1; shift
+for f in "$@"; do
+  best=
+  i=0
+  while [ $i -lt $runs ]; do
+    s=$(date +%s%N)
+    $lisb "$f" > /dev/null 2>&1
+    t=$(( ($(date +%s%N) - s) / 1000000 ))
+    if [ -z "$best" ] || [ $t -lt $best ]; then best=$t; fi
+    i=$((i + 1))
+  done
+  printf "%6s ms  %s\n" "$best" "$f"
+done
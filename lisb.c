@@ -4,8 +4,15 @@
   differentiate q-expressions.)
 */
 
+/* mmap's MAP_ANONYMOUS and open_memstream are hidden
+  by -std=c99 otherwise */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
 #include "mpc.h"
 
 /* If compiling on Windows, use these */
@@ -33,59 +40,720 @@ void add_history(char* unused) {}
 #include <editline/history.h>
 #endif
 
+/* the JIT writes x86-64 code to mmap'd memory */
+#if defined(__x86_64__) && defined(__linux__) && !defined(LISB_NO_JIT)
+#define LISB_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* vector kernels use SSE2 and AVX2 when the CPU has them */
+#if defined(__x86_64__) && !defined(LISB_NO_SIMD)
+#define LISB_SIMD
+#include <immintrin.h>
+#endif
+
+/************************* POOL *************************/
+
+/* lvals and lenvs are carved out of large slabs and
+  recycled through a per-type free list, instead of a
+  malloc/free per object. Compile with -DLISB_NO_POOL to
+  use plain malloc/free (for ASan/Valgrind).
+*/
+
+/* number of objects carved out of each slab */
+#define POOL_SLAB_OBJS 256
+
+/* slab header, objects follow it.
+  'state' is scratch space for the garbage collector */
+typedef struct lslab {
+  struct lslab* next;
+  unsigned char state[POOL_SLAB_OBJS];
+} lslab;
+
+/* a size class: one object size and its free list */
+typedef struct lpool {
+  size_t size;
+  void* free;
+  lslab* slabs;
+  int nslabs;
+
+  /* objects in use, and handed out in total */
+  long live;
+  long allocs;
+} lpool;
+
+/* add a new slab to a pool, threading its objects onto the free list */
+void pool_grow(lpool* p) {
+  lslab* s = malloc(sizeof(lslab) + p->size * POOL_SLAB_OBJS);
+  s->next = p->slabs;
+  p->slabs = s;
+  p->nslabs++;
+
+  char* objs = (char*) (s + 1);
+  for (int i = POOL_SLAB_OBJS-1; i >= 0; i--) {
+    void* x = objs + p->size * i;
+    *(void**) x = p->free;
+    p->free = x;
+  }
+}
+
+/* take an object from a pool */
+void* pool_alloc(lpool* p) {
+  p->live++;
+  p->allocs++;
+#ifdef LISB_NO_POOL
+  return malloc(p->size);
+#else
+  if (!p->free) { pool_grow(p); }
+  void* x = p->free;
+  p->free = *(void**) x;
+  return x;
+#endif
+}
+
+/* return an object to its pool */
+void pool_free(lpool* p, void* x) {
+  p->live--;
+#ifdef LISB_NO_POOL
+  free(x);
+#else
+  *(void**) x = p->free;
+  p->free = x;
+#endif
+}
+
+/* release every slab of a pool */
+void pool_destroy(lpool* p) {
+  while (p->slabs) {
+    lslab* s = p->slabs;
+    p->slabs = s->next;
+    free(s);
+  }
+  p->nslabs = 0;
+  p->free = NULL;
+}
+
+/************************* SYMBOLS *************************/
+
+/* Symbol names are interned: each distinct name is stored
+  once in a global hash table, so two symbols are equal
+  exactly when their name pointers are equal.
+*/
+
+/* interned name, 'name' is what lvals and lenvs point to.
+  'locals' counts its bindings in envs other than the
+  global one and 'global' is its global env slot, or -1 */
+typedef struct lsym {
+  unsigned long hash;
+  int locals;
+  int global;
+  char name[];
+} lsym;
+
+/* open-addressing table of interned names */
+struct {
+  int count;
+  int size;
+  lsym** slots;
+} sym_table;
+
+/* FNV-1a hash of a name */
+unsigned long sym_hash_str(char* s) {
+  unsigned long h = 14695981039346656037UL;
+  while (*s) { h = (h ^ (unsigned char) *s++) * 1099511628211UL; }
+  return h;
+}
+
+/* double the table and rehash every name */
+void sym_table_grow(void) {
+  int size = sym_table.size ? sym_table.size * 2 : 256;
+  lsym** slots = calloc(size, sizeof(lsym*));
+
+  for (int i = 0; i < sym_table.size; i++) {
+    lsym* s = sym_table.slots[i];
+    if (!s) { continue; }
+    int j = s->hash & (size-1);
+    while (slots[j]) { j = (j+1) & (size-1); }
+    slots[j] = s;
+  }
+
+  free(sym_table.slots);
+  sym_table.slots = slots;
+  sym_table.size = size;
+}
+
+/* return the unique copy of a name, adding it if new */
+char* sym_intern(char* name) {
+  /* keep load factor under 1/2 */
+  if (sym_table.count*2 >= sym_table.size) { sym_table_grow(); }
+
+  unsigned long h = sym_hash_str(name);
+  int i = h & (sym_table.size-1);
+  while (sym_table.slots[i]) {
+    lsym* s = sym_table.slots[i];
+    if (s->hash == h && strcmp(s->name, name) == 0) {
+      return s->name;
+    }
+    i = (i+1) & (sym_table.size-1);
+  }
+
+  lsym* s = malloc(sizeof(lsym) + strlen(name) + 1);
+  s->hash = h;
+  s->locals = 0;
+  s->global = -1;
+  strcpy(s->name, name);
+  sym_table.slots[i] = s;
+  sym_table.count++;
+  return s->name;
+}
+
+/* table entry of an interned name */
+lsym* sym_info(char* sym) {
+  return (lsym*) (sym - offsetof(lsym, name));
+}
+
+/* hash of an interned name, computed once by sym_intern */
+unsigned long sym_hash(char* sym) { return sym_info(sym)->hash; }
+
+/* free every interned name */
+void sym_cleanup(void) {
+  for (int i = 0; i < sym_table.size; i++) {
+    free(sym_table.slots[i]);
+  }
+  free(sym_table.slots);
+  sym_table.slots = NULL;
+  sym_table.count = 0;
+  sym_table.size = 0;
+}
+
+/* names the evaluator itself compares against */
+char* sym_amp;
+char* sym_if;
+
+void sym_init(void) {
+  sym_amp = sym_intern("&");
+  sym_if = sym_intern("if");
+}
+
+/************************* BIGNUM *************************/
+
+/* Integers that don't fit in a long are bignums: a sign and
+  a magnitude in 64-bit limbs, least significant first, with
+  no leading zero limbs. Arithmetic stays on longs until it
+  overflows, and results that fit a long go back to being
+  plain numbers (see lval_big), so a bignum is never small.
+*/
+
+typedef unsigned __int128 lbig_wide;
+
+typedef struct lbig {
+  int neg;
+  int len;
+  unsigned long* limbs;
+} lbig;
+
+/* operands at least this many limbs long use Karatsuba.
+  Build with a huge -DLBIG_KARATSUBA for schoolbook only */
+#ifndef LBIG_KARATSUBA
+#define LBIG_KARATSUBA 32
+#endif
+
+/* largest power of ten in a limb, and its digits */
+#define LBIG_DEC_BASE 10000000000000000000UL
+#define LBIG_DEC_DIGITS 19
+
+/* length of a magnitude without its leading zero limbs */
+int lbig_trim(unsigned long* a, int n) {
+  while (n > 0 && a[n-1] == 0) { n--; }
+  return n;
+}
+
+/* compare two trimmed magnitudes, -1, 0 or 1 */
+int lbig_mag_cmp(unsigned long* a, int an, unsigned long* b, int bn) {
+  if (an != bn) { return an < bn ? -1 : 1; }
+  for (int i = an-1; i >= 0; i--) {
+    if (a[i] != b[i]) { return a[i] < b[i] ? -1 : 1; }
+  }
+  return 0;
+}
+
+/* r = a + b, r has room for one limb more than the longer
+  and may be either. Returns the length of r */
+int lbig_mag_add(unsigned long* r, unsigned long* a, int an,
+                 unsigned long* b, int bn) {
+  if (an < bn) {
+    unsigned long* t = a; a = b; b = t;
+    int tn = an; an = bn; bn = tn;
+  }
+  unsigned long carry = 0;
+  for (int i = 0; i < an; i++) {
+    lbig_wide s = (lbig_wide) a[i] + (i < bn ? b[i] : 0) + carry;
+    r[i] = (unsigned long) s;
+    carry = s >> 64;
+  }
+  r[an] = carry;
+  return an + carry;
+}
+
+/* r = a - b for a >= b, r may be a. Returns the trimmed length */
+int lbig_mag_sub(unsigned long* r, unsigned long* a, int an,
+                 unsigned long* b, int bn) {
+  unsigned long borrow = 0;
+  for (int i = 0; i < an; i++) {
+    unsigned long x = a[i];
+    unsigned long y = i < bn ? b[i] : 0;
+    r[i] = x - y - borrow;
+    borrow = x < y || x - y < borrow;
+  }
+  return lbig_trim(r, an);
+}
+
+/* add a into the rn limbs of r, carrying as far as r goes */
+void lbig_mag_add_into(unsigned long* r, int rn, unsigned long* a, int an) {
+  unsigned long carry = 0;
+  int i = 0;
+  for (; i < an && i < rn; i++) {
+    lbig_wide s = (lbig_wide) r[i] + a[i] + carry;
+    r[i] = (unsigned long) s;
+    carry = s >> 64;
+  }
+  for (; carry && i < rn; i++) { carry = ++r[i] == 0; }
+}
+
+/* r = a * b, r has an+bn limbs and is neither. Long operands
+  of similar length are split in halves a1:a0 and b1:b0 and
+  multiplied with three products instead of four (Karatsuba):
+  a0*b0, a1*b1 and (a0+a1)*(b0+b1), less the other two */
+void lbig_mag_mul(unsigned long* r, unsigned long* a, int an,
+                  unsigned long* b, int bn) {
+  if (an < bn) {
+    unsigned long* t = a; a = b; b = t;
+    int tn = an; an = bn; bn = tn;
+  }
+
+  if (bn < LBIG_KARATSUBA) {
+    memset(r, 0, sizeof(unsigned long) * (an+bn));
+    for (int i = 0; i < an; i++) {
+      unsigned long carry = 0;
+      for (int j = 0; j < bn; j++) {
+        lbig_wide t = (lbig_wide) a[i] * b[j] + r[i+j] + carry;
+        r[i+j] = (unsigned long) t;
+        carry = t >> 64;
+      }
+      r[i+bn] = carry;
+    }
+    return;
+  }
+
+  /* a much longer than b: multiply b by pieces of a as long */
+  if (2*bn <= an) {
+    memset(r, 0, sizeof(unsigned long) * (an+bn));
+    unsigned long* t = malloc(sizeof(unsigned long) * 2*bn);
+    for (int i = 0; i < an; i += bn) {
+      int n = an-i < bn ? an-i : bn;
+      lbig_mag_mul(t, a+i, n, b, bn);
+      lbig_mag_add_into(r+i, an+bn-i, t, n+bn);
+    }
+    free(t);
+    return;
+  }
+
+  /* a0*b0 and a1*b1 go straight into r */
+  int m = an / 2;
+  lbig_mag_mul(r, a, m, b, m);
+  lbig_mag_mul(r + 2*m, a+m, an-m, b+m, bn-m);
+
+  unsigned long* sa = malloc(sizeof(unsigned long) * (an-m+1));
+  unsigned long* sb = malloc(sizeof(unsigned long) * (an-m+1));
+  int san = lbig_mag_add(sa, a, m, a+m, an-m);
+  int sbn = lbig_mag_add(sb, b, m, b+m, bn-m);
+  unsigned long* z = malloc(sizeof(unsigned long) * (san+sbn));
+  lbig_mag_mul(z, sa, san, sb, sbn);
+
+  int zn = lbig_mag_sub(z, z, san+sbn, r, lbig_trim(r, 2*m));
+  zn = lbig_mag_sub(z, z, zn, r + 2*m, lbig_trim(r + 2*m, an+bn-2*m));
+  lbig_mag_add_into(r+m, an+bn-m, z, zn);
+
+  free(sa);
+  free(sb);
+  free(z);
+}
+
+/* q = a / d, q may be a. Returns the remainder */
+unsigned long lbig_mag_div_limb(unsigned long* q, unsigned long* a,
+                                int an, unsigned long d) {
+  lbig_wide rem = 0;
+  for (int i = an-1; i >= 0; i--) {
+    lbig_wide x = (rem << 64) | a[i];
+    q[i] = (unsigned long) (x / d);
+    rem = x % d;
+  }
+  return (unsigned long) rem;
+}
+
+/* q = a / b for trimmed a >= b with at least two limbs in b,
+  q has an-bn+1 limbs. Long division as in Knuth's algorithm D:
+  with b shifted so its top bit is set, each quotient limb
+  guessed from the top limbs is at most two too big */
+void lbig_mag_div(unsigned long* q, unsigned long* a, int an,
+                  unsigned long* b, int bn) {
+  int s = __builtin_clzl(b[bn-1]);
+  unsigned long* u = malloc(sizeof(unsigned long) * (an+1));
+  unsigned long* v = malloc(sizeof(unsigned long) * bn);
+  for (int i = bn-1; i > 0; i--) {
+    v[i] = s ? (b[i] << s) | (b[i-1] >> (64-s)) : b[i];
+  }
+  v[0] = b[0] << s;
+  u[an] = s ? a[an-1] >> (64-s) : 0;
+  for (int i = an-1; i > 0; i--) {
+    u[i] = s ? (a[i] << s) | (a[i-1] >> (64-s)) : a[i];
+  }
+  u[0] = a[0] << s;
+
+  for (int j = an-bn; j >= 0; j--) {
+    /* guess from the top two limbs, then correct with the third */
+    lbig_wide top = ((lbig_wide) u[j+bn] << 64) | u[j+bn-1];
+    lbig_wide qhat = top / v[bn-1];
+    lbig_wide rhat = top % v[bn-1];
+    while ((qhat >> 64) ||
+           qhat * v[bn-2] > ((rhat << 64) | u[j+bn-2])) {
+      qhat--;
+      rhat += v[bn-1];
+      if (rhat >> 64) { break; }
+    }
+
+    /* u -= qhat * v at limb j */
+    unsigned long carry = 0;
+    unsigned long borrow = 0;
+    for (int i = 0; i < bn; i++) {
+      lbig_wide p = qhat * v[i] + carry;
+      carry = p >> 64;
+      unsigned long x = u[i+j];
+      unsigned long y = (unsigned long) p;
+      u[i+j] = x - y - borrow;
+      borrow = x < y || x - y < borrow;
+    }
+    unsigned long x = u[j+bn];
+    u[j+bn] = x - carry - borrow;
+    borrow = x < carry || x - carry < borrow;
+
+    /* one too many: add v back */
+    if (borrow) {
+      qhat--;
+      carry = 0;
+      for (int i = 0; i < bn; i++) {
+        lbig_wide t = (lbig_wide) u[i+j] + v[i] + carry;
+        u[i+j] = (unsigned long) t;
+        carry = t >> 64;
+      }
+      u[j+bn] += carry;
+    }
+    q[j] = (unsigned long) qhat;
+  }
+
+  free(u);
+  free(v);
+}
+
+/* view of long x as a bignum, with its limb in *limb */
+lbig lbig_of(long x, unsigned long* limb) {
+  *limb = x < 0 ? -(unsigned long) x : (unsigned long) x;
+  lbig b = { x < 0, x != 0, limb };
+  return b;
+}
+
+/* new bignum with a copy of x's limbs */
+lbig lbig_copy(lbig* x) {
+  lbig r = { x->neg, x->len, malloc(sizeof(unsigned long) * (x->len+1)) };
+  memcpy(r.limbs, x->limbs, sizeof(unsigned long) * x->len);
+  return r;
+}
+
+/* compare x and y, -1, 0 or 1 */
+int lbig_cmp(lbig* x, lbig* y) {
+  if (x->neg != y->neg) { return x->neg ? -1 : 1; }
+  int c = lbig_mag_cmp(x->limbs, x->len, y->limbs, y->len);
+  return x->neg ? -c : c;
+}
+
+/* the arithmetic below sets r to a new bignum */
+
+void lbig_add(lbig* r, lbig* x, lbig* y) {
+  int n = x->len > y->len ? x->len : y->len;
+  r->limbs = malloc(sizeof(unsigned long) * (n+1));
+  if (x->neg == y->neg) {
+    r->neg = x->neg;
+    r->len = lbig_mag_add(r->limbs, x->limbs, x->len, y->limbs, y->len);
+  } else if (lbig_mag_cmp(x->limbs, x->len, y->limbs, y->len) >= 0) {
+    r->neg = x->neg;
+    r->len = lbig_mag_sub(r->limbs, x->limbs, x->len, y->limbs, y->len);
+  } else {
+    r->neg = y->neg;
+    r->len = lbig_mag_sub(r->limbs, y->limbs, y->len, x->limbs, x->len);
+  }
+  if (!r->len) { r->neg = 0; }
+}
+
+void lbig_sub(lbig* r, lbig* x, lbig* y) {
+  lbig ny = *y;
+  ny.neg = !ny.neg;
+  lbig_add(r, x, &ny);
+}
+
+void lbig_mul(lbig* r, lbig* x, lbig* y) {
+  int n = x->len + y->len;
+  r->limbs = malloc(sizeof(unsigned long) * (n+1));
+  lbig_mag_mul(r->limbs, x->limbs, x->len, y->limbs, y->len);
+  r->len = lbig_trim(r->limbs, n);
+  r->neg = r->len && x->neg != y->neg;
+}
+
+/* quotient rounded toward zero, as C does; y must not be 0 */
+void lbig_div(lbig* r, lbig* x, lbig* y) {
+  int n = x->len - y->len + 1;
+  r->limbs = malloc(sizeof(unsigned long) * (n > 0 ? n : 1));
+  if (lbig_mag_cmp(x->limbs, x->len, y->limbs, y->len) < 0) {
+    n = 0;
+  } else if (y->len == 1) {
+    lbig_mag_div_limb(r->limbs, x->limbs, x->len, y->limbs[0]);
+  } else {
+    lbig_mag_div(r->limbs, x->limbs, x->len, y->limbs, y->len);
+  }
+  r->len = lbig_trim(r->limbs, n);
+  r->neg = r->len && x->neg != y->neg;
+}
+
+/* nearest double to x, about */
+double lbig_to_dbl(lbig* x) {
+  double d = 0;
+  for (int i = x->len-1; i >= 0; i--) {
+    d = d * 18446744073709551616.0 + x->limbs[i];
+  }
+  return x->neg ? -d : d;
+}
+
+/* decimal digits of x, to be freed */
+char* lbig_str(lbig* x) {
+  /* split into base 10^19 chunks, lowest first */
+  int n = x->len;
+  unsigned long* t = malloc(sizeof(unsigned long) * (n+1));
+  unsigned long* chunks = malloc(sizeof(unsigned long) * (2*n+1));
+  memcpy(t, x->limbs, sizeof(unsigned long) * n);
+  int count = 0;
+  while (n) {
+    chunks[count++] = lbig_mag_div_limb(t, t, n, LBIG_DEC_BASE);
+    n = lbig_trim(t, n);
+  }
+
+  char* s = malloc((LBIG_DEC_DIGITS+1) * (count+1) + 2);
+  char* p = s;
+  if (x->neg) { *p++ = '-'; }
+  p += sprintf(p, "%lu", count ? chunks[count-1] : 0);
+  for (int i = count-2; i >= 0; i--) {
+    p += sprintf(p, "%0*lu", LBIG_DEC_DIGITS, chunks[i]);
+  }
+  free(t);
+  free(chunks);
+  return s;
+}
+
+/* bignum of decimal digits, with an optional leading '-' */
+lbig lbig_read(char* s) {
+  lbig r = { 0, 0, NULL };
+  if (*s == '-') {
+    r.neg = 1;
+    s++;
+  }
+  int digits = strlen(s);
+  r.limbs = malloc(sizeof(unsigned long) * (digits/LBIG_DEC_DIGITS + 2));
+
+  /* r = r * 10^k + the next k digits, at most 19 at a time */
+  while (*s) {
+    unsigned long chunk = 0;
+    unsigned long scale = 1;
+    for (int k = 0; k < LBIG_DEC_DIGITS && *s; k++) {
+      chunk = chunk * 10 + (*s++ - '0');
+      scale *= 10;
+    }
+    unsigned long carry = chunk;
+    for (int i = 0; i < r.len; i++) {
+      lbig_wide t = (lbig_wide) r.limbs[i] * scale + carry;
+      r.limbs[i] = (unsigned long) t;
+      carry = t >> 64;
+    }
+    if (carry) { r.limbs[r.len++] = carry; }
+  }
+  if (!r.len) { r.neg = 0; }
+  return r;
+}
+
 /************************* LVAL *************************/
 
 /* handle cyclic types */
 struct lval;
 struct lenv;
+struct lcode;
+struct ljit;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct ljit ljit;
 
 /* define the function pointer type lbuiltin */
 typedef lval* (*lbuiltin)(lenv*, lval*);
 
-/* Declare lval struct */
+/* Strings are length-prefixed and may hold any bytes,
+  with a NUL after the last one for printing. Short ones
+  live inline in the lval, longer ones on the heap. */
+#define LSTR_INLINE 24
+
+typedef struct lstr {
+  int len;
+  union {
+    char* heap;
+    char small[LSTR_INLINE];
+  };
+} lstr;
+
+/* Packed vector of 'len' longs, or doubles if 'dbl' */
+typedef struct lvec {
+  int dbl;
+  int len;
+  void* data;
+} lvec;
+
+/* Declare lval struct, a tagged union:
+  only the members for 'type' are valid.
+  lvals are reference counted and shared; one with
+  refs > 1 must not be changed in place (see lval_unshare) */
 struct lval {
   int type;
+  int refs;
+
+  union {
+    /* basic */
+    long num;
+    lbig big;
+    double dbl;
+    lstr err;
+    char* sym;
+    lstr str;
+    lvec vec;
+
+    /* function */
+    struct {
+      lbuiltin builtin;
+      lenv* env;
+      lval* formals;
+      lval* body;
+    };
+
+    /* expression. 'cell' has room for 'cap' children.
+      A slice has a 'base' list and 'cell' points into
+      the base's array, which it shares along with the
+      children instead of owning them. 'code' caches the
+      list compiled as a lambda body, see the VM */
+    struct {
+      int count;
+      int cap;
+      lval** cell;
+      lval* base;
+      lcode* code;
+    };
+  };
+};
 
-  /* basic */
-  long num;
-  char* err;
-  char* sym;
-  char* str;
-
-  /* function */
-  lbuiltin builtin;
-  lenv* env;
-  lval* formals;
-  lval* body;
+/* Compiled code of an expr, run by the VM. 'ops' holds
+  opcodes and their operands, 'depth' is the most values
+  it keeps on the stack. Code for a lambda body reads the
+  values of 'formals' from their env slots. Once 'threaded'
+  its opcodes are replaced by handler offsets. 'ics' are
+  the inline caches of its global lookups. 'calls' and
+  'jit' are for the JIT */
+struct lic;
+typedef struct lic lic;
+
+/* inline cache of a global lookup, see vm_lookup */
+struct lic {
+  unsigned long version;
+  lval* val;
+};
 
-  /* expression */
+struct lcode {
+  int refs;
+  int threaded;
   int count;
-  lval** cell;
+  int cap;
+  int* ops;
+  int nconsts;
+  lval** consts;
+  int nics;
+  lic* ics;
+  int depth;
+  lval* formals;
+  int calls;
+  ljit* jit;
 };
 
+/* lval size class */
+lpool lval_pool = { sizeof(lval) };
+
+lval* lval_alloc(void) {
+  lval* v = pool_alloc(&lval_pool);
+  v->refs = 1;
+  return v;
+}
+void lval_free(lval* v) { pool_free(&lval_pool, v); }
+
 /* Enum of possible lval types */
-enum {LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR,
-      LVAL_QEXPR, LVAL_SEXPR, LVAL_FUN};
+enum {LVAL_ERR, LVAL_NUM, LVAL_BIG, LVAL_DBL, LVAL_SYM, LVAL_STR,
+      LVAL_QEXPR, LVAL_SEXPR, LVAL_FUN, LVAL_VEC};
 
 /* retrieve type name from enum */
 char* ltype_name(int t) {
   switch (t) {
     case LVAL_FUN: return "Function";
     case LVAL_NUM: return "Number";
+    case LVAL_BIG: return "Big Number";
+    case LVAL_DBL: return "Float";
     case LVAL_ERR: return "Error";
     case LVAL_SYM: return "Symbol";
     case LVAL_STR: return "String";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_VEC: return "Vector";
     default: return "Unknown";
   }
 }
 
+/* get the bytes of a string */
+char* lstr_ptr(lstr* s) {
+  return s->len < LSTR_INLINE ? s->small : s->heap;
+}
+
+/* fill a string with a copy of 'len' bytes */
+void lstr_set(lstr* s, char* bytes, int len) {
+  s->len = len;
+  char* p = len < LSTR_INLINE ? s->small : (s->heap = malloc(len + 1));
+  memcpy(p, bytes, len);
+  p[len] = '\0';
+}
+
+/* free a string's heap bytes, if any */
+void lstr_free(lstr* s) {
+  if (s->len >= LSTR_INLINE) { free(s->heap); }
+}
+
+/* compare two strings byte for byte */
+int lstr_eq(lstr* x, lstr* y) {
+  return x->len == y->len
+    && memcmp(lstr_ptr(x), lstr_ptr(y), x->len) == 0;
+}
+
 /* Create a pointer to an error type lval */
 lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_ERR;
 
   /* create a va list */
@@ -93,61 +761,140 @@ lval* lval_err(char* fmt, ...) {
   va_start(va, fmt);
 
   /* printf the error string (511 char max) */
-  v->err = malloc(512);
-  vsnprintf(v->err, 511, fmt, va);
-  v->err = realloc(v->err, strlen(v->err)+1);
+  char buffer[512];
+  vsnprintf(buffer, 511, fmt, va);
+  lstr_set(&v->err, buffer, strlen(buffer));
 
   va_end(va);
   return v;
 }
 
+/* Small numbers are preallocated once and shared, so the
+  counters, lengths and 0/1 truth values that dominate
+  evaluation are never allocated or freed. The cache holds
+  a reference to each, so they are never deleted. */
+#define LVAL_NUM_CACHE_MIN -128
+#define LVAL_NUM_CACHE_MAX 1023
+
+lval* lval_num_cache[LVAL_NUM_CACHE_MAX - LVAL_NUM_CACHE_MIN + 1];
+
 /* Create a pointer to a number type lval */
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
+  if (x >= LVAL_NUM_CACHE_MIN && x <= LVAL_NUM_CACHE_MAX) {
+    lval* v = lval_num_cache[x - LVAL_NUM_CACHE_MIN];
+    if (v) { v->refs++; return v; }
+  }
+
+  lval* v = lval_alloc();
   v->type = LVAL_NUM;
   v->num = x;
   return v;
 }
 
+/* Create a number lval from a bignum, taking its limbs.
+  One that fits a long is a plain number */
+lval* lval_big(lbig b) {
+  unsigned long m = b.len ? b.limbs[0] : 0;
+  if (b.len <= 1 &&
+      (m <= LONG_MAX || (b.neg && m == (unsigned long) LONG_MAX + 1))) {
+    free(b.limbs);
+    return lval_num(b.neg ? (long) -m : (long) m);
+  }
+
+  lval* v = lval_alloc();
+  v->type = LVAL_BIG;
+  v->big = b;
+  return v;
+}
+
+/* view of a number lval as a bignum, using *limb for a long */
+lbig lval_to_big(lval* v, unsigned long* limb) {
+  return v->type == LVAL_NUM ? lbig_of(v->num, limb) : v->big;
+}
+
+/* Create a pointer to a floating point number lval */
+lval* lval_dbl(double x) {
+  lval* v = lval_alloc();
+  v->type = LVAL_DBL;
+  v->dbl = x;
+  return v;
+}
+
+/* is v a number of any kind */
+int lval_is_num(lval* v) {
+  return v->type == LVAL_NUM || v->type == LVAL_BIG || v->type == LVAL_DBL;
+}
+
+/* a number lval as a double */
+double lval_to_dbl(lval* v) {
+  switch (v->type) {
+    case LVAL_NUM: return v->num;
+    case LVAL_BIG: return lbig_to_dbl(&v->big);
+    default: return v->dbl;
+  }
+}
+
+/* Create a vector lval of n elements, not filled in */
+lval* lval_vec(int dbl, int n) {
+  lval* v = lval_alloc();
+  v->type = LVAL_VEC;
+  v->vec.dbl = dbl;
+  v->vec.len = n;
+  v->vec.data = malloc(sizeof(double) * (n ? n : 1));
+  return v;
+}
+
+/* fill the small number cache */
+void lval_num_cache_init(void) {
+  for (long x = LVAL_NUM_CACHE_MIN; x <= LVAL_NUM_CACHE_MAX; x++) {
+    lval_num_cache[x - LVAL_NUM_CACHE_MIN] = lval_num(x);
+  }
+}
+
 /* Create a pointer to a symbol type lval */
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  v->sym = sym_intern(s);
   return v;
 }
 
-/* Create a pointer to a string type lval */
-lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
+/* Create a pointer to a string type lval from 'len' bytes */
+lval* lval_str_len(char* s, int len) {
+  lval* v = lval_alloc();
   v->type = LVAL_STR;
-  v->str = malloc(strlen(s) + 1);
-  strcpy(v->str, s);
+  lstr_set(&v->str, s, len);
   return v;
 }
 
-/* Create a pointer to an empty Qexpr lval */
-lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
-  v->count = 0;
-  v->cell = NULL;
-  return v;
+/* Create a pointer to a string type lval */
+lval* lval_str(char* s) {
+  return lval_str_len(s, strlen(s));
 }
 
-/* Create a pointer to an empty Sexpr lval */
-lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+/* Create a pointer to an empty list lval with room for n children */
+lval* lval_list_sized(int type, int n) {
+  lval* v = lval_alloc();
+  v->type = type;
   v->count = 0;
-  v->cell = NULL;
+  v->cap = n;
+  v->cell = n ? malloc(sizeof(lval*) * n) : NULL;
+  v->base = NULL;
+  v->code = NULL;
   return v;
 }
 
+/* Create a pointer to an empty Qexpr lval */
+lval* lval_qexpr(void) { return lval_list_sized(LVAL_QEXPR, 0); }
+lval* lval_qexpr_sized(int n) { return lval_list_sized(LVAL_QEXPR, n); }
+
+/* Create a pointer to an empty Sexpr lval */
+lval* lval_sexpr(void) { return lval_list_sized(LVAL_SEXPR, 0); }
+lval* lval_sexpr_sized(int n) { return lval_list_sized(LVAL_SEXPR, n); }
+
 /* create a pointer to a function */
 lval* lval_builtin(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_FUN;
   v->builtin = func;
   return v;
@@ -157,7 +904,7 @@ lenv* lenv_new(void);
 
 /* create a pointer to a user-defined func*/
 lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_FUN;
   v->builtin = NULL;
   v->env = lenv_new();
@@ -166,19 +913,57 @@ lval* lval_lambda(lval* formals, lval* body) {
   return v;
 }
 
+lval* lval_unshare(lval* v);
+
+/* is v a list viewing another list's cells */
+int lval_is_slice(lval* v) {
+  return (v->type == LVAL_QEXPR || v->type == LVAL_SEXPR) && v->base;
+}
+
+/* view 'count' cells of list v starting at 'start', in O(1) */
+lval* lval_slice(lval* v, int start, int count) {
+  lval* x = lval_alloc();
+  x->type = v->type;
+  x->count = count;
+  x->cap = count;
+  x->cell = v->cell + start;
+  x->base = v->base ? v->base : v;
+  x->base->refs++;
+  x->code = NULL;
+  return x;
+}
+
+/* make room for at least n children, v must not be shared */
+void lval_reserve(lval* v, int n) {
+  if (n <= v->cap) { return; }
+  v->cap = n;
+  v->cell = realloc(v->cell, sizeof(lval*) * v->cap);
+}
+
 /* Add an lval 'x' as a child to a sexpr 'v' */
 lval* lval_add(lval* v, lval* x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count-1] = x;
+  v = lval_unshare(v);
+  /* grow geometrically so appends are amortized O(1) */
+  if (v->count == v->cap) {
+    lval_reserve(v, v->cap ? v->cap * 2 : 4);
+  }
+  v->cell[v->count++] = x;
   return v;
 }
 
-lenv* lenv_copy(lenv* e);
-
-/* copy an lval */
+/* copy an lval: values are never changed while shared,
+  so a copy is just another reference */
 lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
+  v->refs++;
+  return v;
+}
+
+lenv* lenv_share(lenv* e);
+
+/* make a private copy of the top level of an lval,
+  sharing its children */
+lval* lval_dup(lval* v) {
+  lval* x = lval_alloc();
   x->type = v->type;
 
   switch (v->type) {
@@ -188,7 +973,7 @@ lval* lval_copy(lval* v) {
         x->builtin = v->builtin;
       } else {
         x->builtin = NULL;
-        x->env = lenv_copy(v->env);
+        x->env = lenv_share(v->env);
         x->formals = lval_copy(v->formals);
         x->body = lval_copy(v->body);
       }
@@ -198,25 +983,39 @@ lval* lval_copy(lval* v) {
       x->num = v->num;
       break;
 
+    case LVAL_BIG:
+      x->big = lbig_copy(&v->big);
+      break;
+
+    case LVAL_DBL:
+      x->dbl = v->dbl;
+      break;
+
+    case LVAL_VEC:
+      x->vec = v->vec;
+      x->vec.data = malloc(sizeof(double) * (v->vec.len ? v->vec.len : 1));
+      memcpy(x->vec.data, v->vec.data, sizeof(double) * v->vec.len);
+      break;
+
     case LVAL_ERR:
-      x->err = malloc(strlen(v->err) + 1);
-      strcpy(x->err, v->err);
+      lstr_set(&x->err, lstr_ptr(&v->err), v->err.len);
       break;
 
     case LVAL_SYM:
-      x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym);
+      x->sym = v->sym;
       break;
 
     case LVAL_STR:
-      x->str = malloc(strlen(v->str) + 1);
-      strcpy(x->str, v->str);
+      lstr_set(&x->str, lstr_ptr(&v->str), v->str.len);
       break;
 
-    /* copy lists by copying all sub-exprs */
+    /* copy lists by sharing all sub-exprs */
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       x->count = v->count;
+      x->cap = v->count;
+      x->base = NULL;
+      x->code = NULL;
       x->cell = malloc(sizeof(lval*) * x->count);
       for (int i = 0; i < x->count; i++) {
         x->cell[i] = lval_copy(v->cell[i]);
@@ -226,38 +1025,99 @@ lval* lval_copy(lval* v) {
   return x;
 }
 
+void lval_del(lval* v);
+void jit_free(ljit* j);
+
+/* drop a reference to compiled code */
+void lcode_del(lcode* c) {
+  if (--c->refs > 0) { return; }
+  jit_free(c->jit);
+  for (int i = 0; i < c->nconsts; i++) {
+    lval_del(c->consts[i]);
+  }
+  if (c->formals) { lval_del(c->formals); }
+  free(c->consts);
+  free(c->ics);
+  free(c->ops);
+  free(c);
+}
+
+/* forget the code compiled from a list about to change */
+void lval_drop_code(lval* v) {
+  if (v->code) {
+    lcode_del(v->code);
+    v->code = NULL;
+  }
+}
+
 /* combine two q-exprs */
 lval* lval_join(lval* x, lval* y) {
-  /* add each element in y to x */
+  /* joining onto nothing is just y */
+  if (x->count == 0) {
+    lval_del(x);
+    return y;
+  }
+
+  /* if y is shared or a slice its elements must be shared too */
+  if (y->refs > 1 || y->base) {
+    x = lval_unshare(x);
+    lval_reserve(x, x->count + y->count);
+    for (int i = 0; i < y->count; i++) {
+      x = lval_add(x, lval_copy(y->cell[i]));
+    }
+    lval_del(y);
+    return x;
+  }
+
+  /* otherwise move each element in y to x */
+  x = lval_unshare(x);
+  lval_reserve(x, x->count + y->count);
   for (int i = 0; i < y->count; i++) {
     x = lval_add(x, y->cell[i]);
   }
+  lval_drop_code(y);
   free(y->cell);
-  free(y);
+  lval_free(y);
   return x;
 }
 
-/* func to pull out ith child */
+void lval_own_cells(lval* v);
+
+/* func to pull out ith child, v must not be shared */
 lval* lval_pop(lval* v, int i) {
+  if (v->base) { lval_own_cells(v); }
+  lval_drop_code(v);
+
   /* pull out desired child */
   lval* x = v->cell[i];
   /* shift following items */
   memmove(&v->cell[i], &v->cell[i+1],
           sizeof(lval*) * (v->count-i-1));
   v->count--;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+
+  /* give memory back once the array is mostly empty */
+  if (v->cap > 8 && v->count < v->cap / 4) {
+    v->cap /= 2;
+    v->cell = realloc(v->cell, sizeof(lval*) * v->cap);
+  }
   return x;
 }
 
 void lenv_del(lenv* e);
 
-/* Delete an lval, and all its pointers/data */
+/* Drop a reference to an lval; the last one
+  deletes it, and all its pointers/data */
 void lval_del(lval* v) {
+  if (--v->refs > 0) { return; }
+
   switch (v-> type) {
     case LVAL_NUM: break;
-    case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
+    case LVAL_DBL: break;
+    case LVAL_BIG: free(v->big.limbs); break;
+    case LVAL_VEC: free(v->vec.data); break;
+    case LVAL_ERR: lstr_free(&v->err); break;
+    case LVAL_SYM: break;
+    case LVAL_STR: lstr_free(&v->str); break;
     case LVAL_FUN:
       if (!v->builtin) {
         lenv_del(v->env);
@@ -267,6 +1127,11 @@ void lval_del(lval* v) {
       break;
     case LVAL_QEXPR:
     case LVAL_SEXPR:
+      lval_drop_code(v);
+
+      /* a slice only holds its base */
+      if (v->base) { lval_del(v->base); break; }
+
       /* delete all children */
       for (int i = 0; i < v->count; i++) {
         lval_del(v->cell[i]);
@@ -274,26 +1139,75 @@ void lval_del(lval* v) {
       free(v->cell);
     break;
   }
-  free(v);
+  lval_free(v);
 }
 
 /* func to only take ith child and delete original expr */
 lval* lval_take(lval* v, int i) {
+  /* a shared expr or slice keeps its children, share the one we want */
+  if (v->refs > 1 || v->base) {
+    lval* x = lval_copy(v->cell[i]);
+    lval_del(v);
+    return x;
+  }
+
   lval* x = lval_pop(v, i);
   lval_del(v);
   return x;
 }
 
+/* give a slice its own cell array, v must not be shared */
+void lval_own_cells(lval* v) {
+  lval** cell = malloc(sizeof(lval*) * v->count);
+  for (int i = 0; i < v->count; i++) {
+    cell[i] = lval_copy(v->cell[i]);
+  }
+  lval_del(v->base);
+  v->base = NULL;
+  v->cell = cell;
+  v->cap = v->count;
+}
+
+/* get an lval that is safe to change in place:
+  v itself if unshared, otherwise a private copy.
+  Lists also get their own cell array */
+lval* lval_unshare(lval* v) {
+  if (v->refs == 1) {
+    if (v->type == LVAL_QEXPR || v->type == LVAL_SEXPR) {
+      if (v->base) { lval_own_cells(v); }
+      lval_drop_code(v);
+    }
+    return v;
+  }
+  lval* x = lval_dup(v);
+  lval_del(v);
+  return x;
+}
+
 /* prep for mutual recursion */
 void lval_print(lval* v);
 
+/* C escapes understood by the reader and printer,
+  the same set mpc uses: a raw byte and its code */
+char lstr_esc_raw[]  = {'\a', '\b', '\f', '\n', '\r', '\t',
+                        '\v', '\\', '\'', '\"', '\0'};
+char lstr_esc_code[] = {'a', 'b', 'f', 'n', 'r', 't',
+                        'v', '\\', '\'', '"', '0'};
+
 /* strings must be escaped before printing */
 void lval_print_str(lval* v) {
-  char* escaped = malloc(strlen(v->str) + 1);
-  strcpy(escaped, v->str);
-  escaped = mpcf_escape(escaped);
-  printf("\"%s\"", escaped);
-  free(escaped);
+  char* s = lstr_ptr(&v->str);
+  putchar('"');
+  for (int i = 0; i < v->str.len; i++) {
+    char* esc = memchr(lstr_esc_raw, s[i], sizeof(lstr_esc_raw));
+    if (esc) {
+      putchar('\\');
+      putchar(lstr_esc_code[esc - lstr_esc_raw]);
+    } else {
+      putchar(s[i]);
+    }
+  }
+  putchar('"');
 }
 
 /* print an expr */
@@ -309,14 +1223,48 @@ void lval_print_expr(lval* v, char open, char close) {
   putchar(close);
 }
 
+/* print a double as the shortest %g that reads back
+  the same, with a '.' if it would look like an integer */
+void lval_print_dbl(double x) {
+  char buf[32];
+  for (int p = 15; p <= 17; p++) {
+    snprintf(buf, sizeof(buf), "%.*g", p, x);
+    if (strtod(buf, NULL) == x) { break; }
+  }
+  fputs(buf, stdout);
+  if (!strpbrk(buf, ".eni")) { fputs(".0", stdout); }
+}
+
+/* print a vector as the expression that makes it */
+void lval_print_vec(lvec* v) {
+  fputs("(vec {", stdout);
+  for (int i = 0; i < v->len; i++) {
+    if (i) { putchar(' '); }
+    if (v->dbl) { lval_print_dbl(((double*) v->data)[i]); }
+    else { printf("%li", ((long*) v->data)[i]); }
+  }
+  fputs("})", stdout);
+}
+
 /* print an lval */
 void lval_print(lval* v) {
   switch (v->type) {
     case LVAL_NUM: printf("%li", v->num); break;
-    case LVAL_ERR: printf("Error: %s", v->err); break;
-    case LVAL_SYM: printf("%s", v->sym); break;
-    case LVAL_STR: lval_print_str(v); break;
-    case LVAL_QEXPR: lval_print_expr(v, '{', '}'); break;
+    case LVAL_BIG: {
+      char* s = lbig_str(&v->big);
+      fputs(s, stdout);
+      free(s);
+      break;
+    }
+    case LVAL_DBL: lval_print_dbl(v->dbl); break;
+    case LVAL_VEC: lval_print_vec(&v->vec); break;
+    case LVAL_ERR:
+      printf("Error: ");
+      fwrite(lstr_ptr(&v->err), 1, v->err.len, stdout);
+      break;
+    case LVAL_SYM: printf("%s", v->sym); break;
+    case LVAL_STR: lval_print_str(v); break;
+    case LVAL_QEXPR: lval_print_expr(v, '{', '}'); break;
     case LVAL_SEXPR: lval_print_expr(v, '(', ')'); break;
     case LVAL_FUN:
       if (v->builtin) { printf("<builtin>"); }
@@ -336,13 +1284,28 @@ void lval_println(lval* v) { lval_print(v); putchar('\n'); }
 
 /* check equality of two lvals */
 int lval_eq(lval* x, lval* y) {
+  /* a float equals an integer of the same value */
+  if ((x->type == LVAL_DBL || y->type == LVAL_DBL) &&
+      lval_is_num(x) && lval_is_num(y)) {
+    return lval_to_dbl(x) == lval_to_dbl(y);
+  }
   if (x->type != y->type) {return 0;}
 
   switch (x->type) {
     case LVAL_NUM: return (x->num == y->num);
-    case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-    case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-    case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+    case LVAL_BIG: return lbig_cmp(&x->big, &y->big) == 0;
+    case LVAL_VEC:
+      if (x->vec.dbl != y->vec.dbl || x->vec.len != y->vec.len) { return 0; }
+      for (int i = 0; i < x->vec.len; i++) {
+        int same = x->vec.dbl
+          ? ((double*) x->vec.data)[i] == ((double*) y->vec.data)[i]
+          : ((long*) x->vec.data)[i] == ((long*) y->vec.data)[i];
+        if (!same) { return 0; }
+      }
+      return 1;
+    case LVAL_ERR: return lstr_eq(&x->err, &y->err);
+    case LVAL_SYM: return (x->sym == y->sym);
+    case LVAL_STR: return lstr_eq(&x->str, &y->str);
 
     case LVAL_FUN:
       if (x->builtin || y->builtin) {
@@ -366,33 +1329,130 @@ int lval_eq(lval* x, lval* y) {
 
 /************************* LENV *************************/
 
-/* define lenv environments */
+/* frames with more bindings than this get a hash index */
+#define LENV_HASH_MIN 8
+
+/* define lenv environments, syms are interned names.
+  Bindings live in the parallel syms/vals arrays; large
+  frames (the global env) also keep 'index', an
+  open-addressing table of array slots (-1 = empty).
+  Copies of a lambda share its env, counted in 'refs',
+  until a call binds args into it (lenv_unshare). */
 struct lenv {
+  int refs;
   lenv* parent;
   int count;
   char** syms;
   lval** vals;
+  int index_size;
+  int* index;
 };
 
+/* lenv size class */
+lpool lenv_pool = { sizeof(lenv) };
+
+lenv* lenv_alloc(void) { return pool_alloc(&lenv_pool); }
+void lenv_free(lenv* e) { pool_free(&lenv_pool, e); }
+
 /* create a new lenv */
 lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
+  lenv* e = lenv_alloc();
+  e->refs = 1;
   e->parent = NULL;
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->index_size = 0;
+  e->index = NULL;
   return e;
 }
 
+/* place slot i of an env into its hash index */
+void lenv_index_add(lenv* e, int i) {
+  int mask = e->index_size-1;
+  int j = sym_hash(e->syms[i]) & mask;
+  while (e->index[j] != -1) { j = (j+1) & mask; }
+  e->index[j] = i;
+}
+
+/* rebuild the hash index with room for the current bindings */
+void lenv_index_build(lenv* e) {
+  int size = 16;
+  while (size < e->count*2) { size *= 2; }
+
+  free(e->index);
+  e->index_size = size;
+  e->index = malloc(sizeof(int) * size);
+  for (int j = 0; j < size; j++) { e->index[j] = -1; }
+  for (int i = 0; i < e->count; i++) { lenv_index_add(e, i); }
+}
+
+/* find the slot holding a symbol in this frame only, or -1 */
+int lenv_find(lenv* e, char* sym) {
+  /* small frames: scan */
+  if (!e->index) {
+    for (int i = 0; i < e->count; i++) {
+      if (e->syms[i] == sym) { return i; }
+    }
+    return -1;
+  }
+
+  /* large frames: probe the index */
+  int mask = e->index_size-1;
+  int j = sym_hash(sym) & mask;
+  while (e->index[j] != -1) {
+    if (e->syms[e->index[j]] == sym) { return e->index[j]; }
+    j = (j+1) & mask;
+  }
+  return -1;
+}
+
+/* Every name counts its bindings outside the global env.
+  While it has none, looking it up from any env can only
+  find its global binding, so the lookup goes straight to
+  the global slot instead of walking the chain of callers.
+  'def' and '=' add bindings through lenv_put and frames
+  drop theirs when deleted, so the counts stay exact */
+
+lenv* lenv_global(void);
+
+/* bumped on every change to the global env's bindings,
+  see the VM's inline caches */
+unsigned long lenv_version = 0;
+
+/* note a new binding of 'sym' in 'e' */
+void lenv_bound(lenv* e, char* sym) {
+  lsym* s = sym_info(sym);
+  if (e == lenv_global()) {
+    s->global = e->count-1;
+    lenv_version++;
+  } else {
+    s->locals++;
+  }
+}
+
+/* drop every binding of 'e' from the counts */
+void lenv_unbound(lenv* e) {
+  for (int i = 0; i < e->count; i++) {
+    lsym* s = sym_info(e->syms[i]);
+    if (e == lenv_global()) {
+      s->global = -1;
+      lenv_version++;
+    } else {
+      s->locals--;
+    }
+  }
+}
+
 /* add a value to an env */
 void lenv_put(lenv* e, lval* k, lval* v) {
   /* if key already exists, replace */
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
+  int i = lenv_find(e, k->sym);
+  if (i != -1) {
+    lval_del(e->vals[i]);
+    e->vals[i] = lval_copy(v);
+    if (e == lenv_global()) { lenv_version++; }
+    return;
   }
 
   /* otherwise add variable to env */
@@ -401,8 +1461,17 @@ void lenv_put(lenv* e, lval* k, lval* v) {
   e->syms = realloc(e->syms, sizeof(char*) * e->count);
 
   e->vals[e->count-1] = lval_copy(v);
-  e->syms[e->count-1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count-1], k->sym);
+  e->syms[e->count-1] = k->sym;
+  lenv_bound(e, k->sym);
+
+  /* keep the index under 1/2 full once the frame is large */
+  if (e->count > LENV_HASH_MIN) {
+    if (e->count*2 > e->index_size) {
+      lenv_index_build(e);
+    } else {
+      lenv_index_add(e, e->count-1);
+    }
+  }
 }
 
 /* add a global value */
@@ -412,15 +1481,29 @@ void lenv_put_global(lenv* e, lval* k, lval* v) {
   lenv_put(e, k, v);
 }
 
+/* does 'inner' have a binding hiding every binding of 'outer' */
+int lenv_shadows(lenv* inner, lenv* outer) {
+  for (int i = 0; i < outer->count; i++) {
+    if (lenv_find(inner, outer->syms[i]) == -1) { return 0; }
+  }
+  return 1;
+}
+
 /* copy a value from an env */
 lval* lenv_get(lenv* e, lval* k) {
-  /* iterate through env and grab value */
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
+  /* only bound globally, if at all */
+  lsym* s = sym_info(k->sym);
+  if (!s->locals) {
+    if (s->global == -1) {
+      return lval_err("key '%s' not in environment", k->sym);
     }
+    return lval_copy(lenv_global()->vals[s->global]);
   }
 
+  /* look in this frame and grab value */
+  int i = lenv_find(e, k->sym);
+  if (i != -1) { return lval_copy(e->vals[i]); }
+
   /* if not found, check parent */
   if (e->parent) {
     return lenv_get(e->parent, k);
@@ -429,32 +1512,326 @@ lval* lenv_get(lenv* e, lval* k) {
   }
 }
 
+/* the value of a symbol without copying it, or NULL */
+lval* lenv_peek(lenv* e, char* sym) {
+  lsym* s = sym_info(sym);
+  if (!s->locals) {
+    return s->global == -1 ? NULL : lenv_global()->vals[s->global];
+  }
+  for (; e; e = e->parent) {
+    int i = lenv_find(e, sym);
+    if (i != -1) { return e->vals[i]; }
+  }
+  return NULL;
+}
+
 /* copy an lenv */
 lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
+  lenv* n = lenv_alloc();
+  n->refs = 1;
   n->parent = e->parent;
   n->count = e->count;
   n->syms = malloc(sizeof(char*) * n->count);
   n->vals = malloc(sizeof(lval*) * n->count);
 
   for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
+    n->syms[i] = e->syms[i];
     n->vals[i] = lval_copy(e->vals[i]);
+    sym_info(n->syms[i])->locals++;
   }
 
+  n->index_size = e->index_size;
+  n->index = NULL;
+  if (e->index) {
+    n->index = malloc(sizeof(int) * n->index_size);
+    memcpy(n->index, e->index, sizeof(int) * n->index_size);
+  }
+
+  return n;
+}
+
+/* another reference to an env */
+lenv* lenv_share(lenv* e) {
+  e->refs++;
+  return e;
+}
+
+/* get an env that is safe to change: e itself if only
+  one lambda has it, otherwise a private copy */
+lenv* lenv_unshare(lenv* e) {
+  if (e->refs == 1) { return e; }
+  e->refs--;
+  if (e->count) { return lenv_copy(e); }
+  lenv* n = lenv_new();
+  n->parent = e->parent;
   return n;
 }
 
 /* delete an lenv */
 void lenv_del(lenv* e) {
+  if (--e->refs > 0) { return; }
+  lenv_unbound(e);
   for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
     lval_del(e->vals[i]);
   }
   free(e->syms);
   free(e->vals);
-  free(e);
+  free(e->index);
+  lenv_free(e);
+}
+
+/************************* GC *************************/
+
+/* Reference counting frees values as soon as they are
+  dropped. The tracing collector backs it up: it marks
+  everything reachable from the global env and the root
+  stack, then sweeps any pooled object that was not
+  reached but is still allocated (a leaked reference).
+  It only runs at safe points, between top-level forms,
+  where no evaluation temporaries live on the C stack.
+  Needs the pools: it is a no-op with LISB_NO_POOL.
+*/
+
+/* collect after this many lval allocations, at least */
+#define GC_MIN_THRESHOLD 100000
+
+/* slot states during a collection */
+enum { GC_UNSEEN, GC_MARKED, GC_FREE };
+
+/* a pool's slabs, sorted by address, during a collection */
+typedef struct gc_slabs {
+  lpool* pool;
+  int count;
+  lslab** slabs;
+} gc_slabs;
+
+/* collector state */
+struct {
+  lenv* global;
+
+  /* temporaries that must survive a collection, a stack
+    that grows with nested loads */
+  int nroots;
+  int roots_cap;
+  lval** roots;
+
+  /* nesting of s-expr evaluation, 0 at safe points */
+  int depth;
+
+  long threshold;
+  long last_allocs;
+  long collections;
+  long reclaimed;
+
+  gc_slabs vals;
+  gc_slabs envs;
+} gc = { NULL, 0, 0, NULL, 0, GC_MIN_THRESHOLD };
+
+lenv* lenv_global(void) { return gc.global; }
+
+void gc_root_push(lval* v) {
+  if (gc.nroots == gc.roots_cap) {
+    gc.roots_cap = gc.roots_cap ? gc.roots_cap * 2 : 64;
+    gc.roots = realloc(gc.roots, sizeof(lval*) * gc.roots_cap);
+  }
+  gc.roots[gc.nroots++] = v;
+}
+void gc_root_pop(void) { gc.nroots--; }
+
+int gc_slab_cmp(const void* a, const void* b) {
+  char* x = *(char**) a;
+  char* y = *(char**) b;
+  return (x > y) - (x < y);
+}
+
+/* find the state byte of a pooled object */
+unsigned char* gc_state(gc_slabs* g, void* x) {
+  int lo = 0, hi = g->count-1;
+  while (lo < hi) {
+    int mid = (lo+hi+1) / 2;
+    if ((char*) g->slabs[mid] <= (char*) x) { lo = mid; }
+    else { hi = mid-1; }
+  }
+  lslab* s = g->slabs[lo];
+  return &s->state[((char*) x - (char*) (s+1)) / g->pool->size];
+}
+
+/* snapshot a pool's slabs and reset their slot states */
+void gc_slabs_begin(gc_slabs* g, lpool* p) {
+  g->pool = p;
+  g->count = p->nslabs;
+  g->slabs = malloc(sizeof(lslab*) * g->count);
+
+  int i = 0;
+  for (lslab* s = p->slabs; s; s = s->next) {
+    memset(s->state, GC_UNSEEN, POOL_SLAB_OBJS);
+    g->slabs[i++] = s;
+  }
+  qsort(g->slabs, g->count, sizeof(lslab*), gc_slab_cmp);
+
+  /* free slots are not candidates for sweeping */
+  for (void* x = p->free; x; x = *(void**) x) {
+    *gc_state(g, x) = GC_FREE;
+  }
+}
+
+void gc_mark_lenv(lenv* e);
+
+/* mark an lval and everything it owns */
+void gc_mark_lval(lval* v) {
+  unsigned char* st = gc_state(&gc.vals, v);
+  if (*st == GC_MARKED) { return; }
+  *st = GC_MARKED;
+
+  switch (v->type) {
+    case LVAL_FUN:
+      if (!v->builtin) {
+        gc_mark_lenv(v->env);
+        gc_mark_lval(v->formals);
+        gc_mark_lval(v->body);
+      }
+      break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      if (v->code) {
+        for (int i = 0; i < v->code->nconsts; i++) {
+          gc_mark_lval(v->code->consts[i]);
+        }
+        if (v->code->formals) { gc_mark_lval(v->code->formals); }
+      }
+      if (v->base) { gc_mark_lval(v->base); break; }
+      for (int i = 0; i < v->count; i++) {
+        gc_mark_lval(v->cell[i]);
+      }
+      break;
+  }
+}
+
+/* mark an env's bindings, parents are not owned */
+void gc_mark_lenv(lenv* e) {
+  unsigned char* st = gc_state(&gc.envs, e);
+  if (*st == GC_MARKED) { return; }
+  *st = GC_MARKED;
+
+  for (int i = 0; i < e->count; i++) {
+    gc_mark_lval(e->vals[i]);
+  }
+}
+
+/* drop a dead object's reference to a live one */
+void gc_release(lval* v) {
+  if (*gc_state(&gc.vals, v) == GC_MARKED) { v->refs--; }
+}
+
+/* free an unreachable lval; its unreachable children
+  are swept on their own, live ones lose a reference */
+void gc_sweep_lval(lval* v) {
+  switch (v->type) {
+    case LVAL_BIG: free(v->big.limbs); break;
+    case LVAL_VEC: free(v->vec.data); break;
+    case LVAL_ERR: lstr_free(&v->err); break;
+    case LVAL_STR: lstr_free(&v->str); break;
+    case LVAL_FUN:
+      if (!v->builtin) {
+        if (*gc_state(&gc.envs, v->env) == GC_MARKED) { v->env->refs--; }
+        gc_release(v->formals);
+        gc_release(v->body);
+      }
+      break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      /* no code is running at a safe point */
+      if (v->code) {
+        for (int i = 0; i < v->code->nconsts; i++) {
+          gc_release(v->code->consts[i]);
+        }
+        if (v->code->formals) { gc_release(v->code->formals); }
+        jit_free(v->code->jit);
+        free(v->code->consts);
+        free(v->code->ics);
+        free(v->code->ops);
+        free(v->code);
+      }
+      if (v->base) { gc_release(v->base); break; }
+      for (int i = 0; i < v->count; i++) {
+        gc_release(v->cell[i]);
+      }
+      free(v->cell);
+      break;
+  }
+  lval_free(v);
+}
+
+/* free an unreachable lenv */
+void gc_sweep_lenv(lenv* e) {
+  lenv_unbound(e);
+  for (int i = 0; i < e->count; i++) {
+    gc_release(e->vals[i]);
+  }
+  free(e->syms);
+  free(e->vals);
+  free(e->index);
+  lenv_free(e);
+}
+
+/* sweep every slot of a pool left unseen by marking */
+long gc_sweep(gc_slabs* g, void (*sweep)(void*)) {
+  long n = 0;
+  for (int i = 0; i < g->count; i++) {
+    lslab* s = g->slabs[i];
+    char* objs = (char*) (s + 1);
+    for (int j = 0; j < POOL_SLAB_OBJS; j++) {
+      if (s->state[j] == GC_UNSEEN) {
+        sweep(objs + g->pool->size * j);
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+void native_mark(void);
+
+/* run a full collection */
+void gc_collect(void) {
+#ifndef LISB_NO_POOL
+  gc_slabs_begin(&gc.vals, &lval_pool);
+  gc_slabs_begin(&gc.envs, &lenv_pool);
+
+  /* mark */
+  gc_mark_lenv(gc.global);
+  for (int i = 0; i <= LVAL_NUM_CACHE_MAX - LVAL_NUM_CACHE_MIN; i++) {
+    gc_mark_lval(lval_num_cache[i]);
+  }
+  for (int i = 0; i < gc.nroots; i++) {
+    gc_mark_lval(gc.roots[i]);
+  }
+  native_mark();
+
+  /* sweep, lvals first since they read env slot states */
+  long n = gc_sweep(&gc.vals, (void (*)(void*)) gc_sweep_lval);
+  n += gc_sweep(&gc.envs, (void (*)(void*)) gc_sweep_lenv);
+  free(gc.vals.slabs);
+  free(gc.envs.slabs);
+
+  gc.collections++;
+  gc.reclaimed += n;
+
+  /* next collection once the heap has been churned through twice */
+  gc.threshold = lval_pool.live * 2;
+  if (gc.threshold < GC_MIN_THRESHOLD) {
+    gc.threshold = GC_MIN_THRESHOLD;
+  }
+#endif
+  gc.last_allocs = lval_pool.allocs;
+}
+
+/* safe point: collect if enough has been allocated since the last time */
+void gc_maybe_collect(void) {
+  if (gc.depth > 0 || !gc.global) { return; }
+  if (lval_pool.allocs - gc.last_allocs >= gc.threshold) {
+    gc_collect();
+  }
 }
 
 /************************* MACROS *************************/
@@ -479,6 +1856,14 @@ void lenv_del(lenv* e) {
           func, index, ltype_name(expect),                \
           ltype_name(args->cell[index]->type))
 
+/* a number of any kind */
+#define LASSERT_ARG_NUM(func, args, index)                      \
+  LASSERT(args, lval_is_num(args->cell[index]),                 \
+          "'%s' passed incorrect type for argument %i. "        \
+          "Expected %s, got %s.",                               \
+          func, index, ltype_name(LVAL_NUM),                    \
+          ltype_name(args->cell[index]->type))
+
 #define LASSERT_NOT_EMPTY(func, args, index)    \
   LASSERT(args, args->cell[index]->count != 0,  \
           "'%s' passed {} for argument %i.",    \
@@ -487,6 +1872,12 @@ void lenv_del(lenv* e) {
 /************************* BUILTIN FUNCS *************************/
 
 lval* lval_eval(lenv* e, lval* v);
+void lval_backtrace(void);
+lcode* vm_body_code(lval* f, int slots);
+
+/* evaluation strategy, picked on the command line */
+enum { EVAL_TREE, EVAL_CEK, EVAL_VM };
+int eval_mode = EVAL_TREE;
 
 /* perform head command */
 lval* builtin_head(lenv* e, lval* a) {
@@ -494,9 +1885,11 @@ lval* builtin_head(lenv* e, lval* a) {
   LASSERT_ARG_TYPE("head", a, 0, LVAL_QEXPR);
   LASSERT_NOT_EMPTY("head", a, 0);
 
+  /* view of the first cell */
   lval* v = lval_take(a, 0);
-  while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-  return v;
+  lval* x = lval_slice(v, 0, 1);
+  lval_del(v);
+  return x;
 }
 
 /* perform tail command */
@@ -505,9 +1898,11 @@ lval* builtin_tail(lenv* e, lval* a) {
   LASSERT_ARG_TYPE("tail", a, 0, LVAL_QEXPR);
   LASSERT_NOT_EMPTY("tail", a, 0);
 
+  /* view of all but the first cell */
   lval* v = lval_take(a, 0);
-  lval_del(lval_pop(v, 0));
-  return v;
+  lval* x = lval_slice(v, 1, v->count-1);
+  lval_del(v);
+  return x;
 }
 
 /* perform list operation (make a q-expr from an s-expr) */
@@ -516,12 +1911,19 @@ lval* builtin_list(lenv* e, lval* a) {
   return a;
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
+/* get the s-expr 'eval' runs, lval_eval runs it as a tail call */
+lval* builtin_eval_expr(lenv* e, lval* a) {
   LASSERT_NUM_ARGS("eval", a, 1);
   LASSERT_ARG_TYPE("eval", a, 0, LVAL_QEXPR);
 
-  lval* x = lval_take(a, 0);
+  lval* x = lval_unshare(lval_take(a, 0));
   x->type = LVAL_SEXPR;
+  return x;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+  lval* x = builtin_eval_expr(e, a);
+  if (x->type == LVAL_ERR) { return x; }
   return lval_eval(e, x);
 }
 
@@ -539,142 +1941,213 @@ lval* builtin_join(lenv* e, lval* a) {
   return x;
 }
 
-/* perform an operation */
-lval* builtin_op(lenv* e, lval* a, char* op) {
-
-  /* all elements should be numbers */
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_ARG_TYPE(op, a, i, LVAL_NUM);
-  }
-  /* pop first element */
-  lval* x = lval_pop(a, 0);
+/* Arithmetic builtins are generated from this table of
+  name, symbol, C operator and flags. Each folds over its
+  argument array in place, and two numbers skip the loop.
+  Longs are used until one overflows, then the whole fold
+  is redone in bignums (lnum_* and lbig_* for each name).
+  Any float makes it a fold of doubles with the C operator */
+enum { ARITH_NEGATES = 1, ARITH_NONZERO = 2 };
+
+#define LISB_ARITH_OPS(X)       \
+  X(add, "+", +, 0)             \
+  X(sub, "-", -, ARITH_NEGATES) \
+  X(mul, "*", *, 0)             \
+  X(div, "/", /, ARITH_NONZERO)
+
+/* long arithmetic, returns 1 if it overflowed */
+int lnum_add(long x, long y, long* r) { return __builtin_add_overflow(x, y, r); }
+int lnum_sub(long x, long y, long* r) { return __builtin_sub_overflow(x, y, r); }
+int lnum_mul(long x, long y, long* r) { return __builtin_mul_overflow(x, y, r); }
+
+/* y must not be 0 */
+int lnum_div(long x, long y, long* r) {
+  if (x == LONG_MIN && y == -1) { return 1; }
+  *r = x / y;
+  return 0;
+}
 
-  /* if op is "-" and only one element, perform negation */
-  if((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
+/* the result of a fold over a, in the storage of its first
+  operand if nothing else holds it */
+lval* lval_num_result(lval* a, long r) {
+  lval* x = a->cell[0];
+  if (a->refs == 1 && !a->base && x->refs == 1) {
+    x->num = r;
+    return lval_take(a, 0);
   }
+  lval_del(a);
+  return lval_num(r);
+}
 
-  /* loop through remaining elements */
-  while (a->count > 0) {
-    lval* y = lval_pop(a, 0);
-
-    if (strcmp(op, "+") == 0) { x->num += y->num; }
-    if (strcmp(op, "-") == 0) { x->num -= y->num; }
-    if (strcmp(op, "*") == 0) { x->num *= y->num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division by zero"); break;
+/* the double result of a fold over a, in the storage of
+  one of its floats if nothing else holds it */
+lval* lval_dbl_result(lval* a, double r) {
+  if (a->refs == 1 && !a->base) {
+    for (int i = 0; i < a->count; i++) {
+      lval* x = a->cell[i];
+      if (x->type == LVAL_DBL && x->refs == 1) {
+        x->dbl = r;
+        return lval_take(a, i);
       }
-      x->num /= y->num;
     }
-    lval_del(y);
   }
   lval_del(a);
-  return x;
+  return lval_dbl(r);
 }
 
-/* built in math funcs */
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+/* is a number 0 */
+int lval_is_zero(lval* v) {
+  switch (v->type) {
+    case LVAL_NUM: return v->num == 0;
+    case LVAL_DBL: return v->dbl == 0;
+    default: return 0;
+  }
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+/* fold 'op' over the checked numbers of a in bignums */
+lval* lval_big_fold(lval* a, void (*op)(lbig*, lbig*, lbig*), int flags) {
+  unsigned long limb;
+  lbig x = lval_to_big(a->cell[0], &limb);
+  lbig r = lbig_copy(&x);
+  if ((flags & ARITH_NEGATES) && a->count == 1) { r.neg = r.len && !r.neg; }
+
+  for (int i = 1; i < a->count; i++) {
+    lbig y = lval_to_big(a->cell[i], &limb);
+    lbig t;
+    op(&t, &r, &y);
+    free(r.limbs);
+    r = t;
+  }
+  lval_del(a);
+  return lval_big(r);
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
-}
+#define LISB_ARITH_BUILTIN(name, sym, op, flags)                 \
+  lval* builtin_##name(lenv* e, lval* a) {                       \
+    long r;                                                      \
+    if (a->count == 2 && a->cell[0]->type == LVAL_NUM &&         \
+        a->cell[1]->type == LVAL_NUM) {                          \
+      long y = a->cell[1]->num;                                  \
+      LASSERT(a, !((flags) & ARITH_NONZERO) || y != 0,           \
+              "Division by zero");                               \
+      if (!lnum_##name(a->cell[0]->num, y, &r)) {                \
+        return lval_num_result(a, r);                            \
+      }                                                          \
+      return lval_big_fold(a, lbig_##name, flags);               \
+    }                                                            \
+                                                                 \
+    LASSERT(a, a->count > 0, "'%s' passed no arguments.", sym);  \
+    for (int i = 0; i < a->count; i++) {                         \
+      LASSERT_ARG_NUM(sym, a, i);                                \
+    }                                                            \
+    int dbl = a->cell[0]->type == LVAL_DBL;                      \
+    for (int i = 1; i < a->count; i++) {                         \
+      LASSERT(a, !((flags) & ARITH_NONZERO) ||                   \
+              !lval_is_zero(a->cell[i]), "Division by zero");    \
+      dbl = dbl || a->cell[i]->type == LVAL_DBL;                 \
+    }                                                            \
+                                                                 \
+    if (dbl) {                                                   \
+      double d = lval_to_dbl(a->cell[0]);                        \
+      if (((flags) & ARITH_NEGATES) && a->count == 1) { d = -d; } \
+      for (int i = 1; i < a->count; i++) {                       \
+        d = d op lval_to_dbl(a->cell[i]);                        \
+      }                                                          \
+      return lval_dbl_result(a, d);                              \
+    }                                                            \
+                                                                 \
+    int small = a->cell[0]->type == LVAL_NUM;                    \
+    r = small ? a->cell[0]->num : 0;                             \
+    if (small && ((flags) & ARITH_NEGATES) && a->count == 1) {   \
+      small = !lnum_sub(0, r, &r);                               \
+    }                                                            \
+    for (int i = 1; small && i < a->count; i++) {                \
+      lval* y = a->cell[i];                                      \
+      small = y->type == LVAL_NUM && !lnum_##name(r, y->num, &r); \
+    }                                                            \
+    return small ? lval_num_result(a, r)                         \
+                 : lval_big_fold(a, lbig_##name, flags);         \
+  }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
-}
+LISB_ARITH_OPS(LISB_ARITH_BUILTIN)
 
 /* handle equivalence checks */
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-  LASSERT_NUM_ARGS(op, a, 2);
-  int r;
-  if (strcmp(op, "==") == 0) {
-    r = lval_eq(a->cell[0], a->cell[1]);
-  }
-  if (strcmp(op, "!=") == 0) {
-    r = !lval_eq(a->cell[0], a->cell[1]);
-  }
+lval* builtin_eq(lenv* e, lval* a) {
+  LASSERT_NUM_ARGS("==", a, 2);
+  int r = lval_eq(a->cell[0], a->cell[1]);
   lval_del(a);
   return lval_num(r);
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "==");
-}
-
 lval* builtin_ne(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "!=");
-}
-
-/* handle other comparison ops, 0 = false, 1 = true */
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-  LASSERT_NUM_ARGS(op, a, 2);
-  LASSERT_ARG_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT_ARG_TYPE(op, a, 1, LVAL_NUM);
-
-  int r;
-  if (strcmp(op, ">") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
-  }
-  if (strcmp(op, "<") == 0) {
-    r = (a->cell[0]->num < a->cell[1]->num);
-  }
-  if (strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num >= a->cell[1]->num);
-  }
-  if (strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num <= a->cell[1]->num);
-  }
-
+  LASSERT_NUM_ARGS("!=", a, 2);
+  int r = !lval_eq(a->cell[0], a->cell[1]);
   lval_del(a);
   return lval_num(r);
 }
 
-lval* builtin_greater(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">");
-}
-
-lval* builtin_less(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<");
+/* other comparisons are generated the same way,
+  0 = false, 1 = true */
+#define LISB_ORD_OPS(X)          \
+  X(greater, ">", >)             \
+  X(less, "<", <)                \
+  X(weak_greater, ">=", >=)      \
+  X(weak_less, "<=", <=)
+
+/* compare two numbers, -1, 0 or 1 */
+int lval_num_cmp(lval* x, lval* y) {
+  unsigned long xl, yl;
+  lbig xb = lval_to_big(x, &xl);
+  lbig yb = lval_to_big(y, &yl);
+  return lbig_cmp(&xb, &yb);
 }
 
-lval* builtin_weak_greater(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">=");
-}
+#define LISB_ORD_BUILTIN(name, sym, op)                          \
+  lval* builtin_##name(lenv* e, lval* a) {                       \
+    LASSERT_NUM_ARGS(sym, a, 2);                                 \
+    LASSERT_ARG_NUM(sym, a, 0);                                  \
+    LASSERT_ARG_NUM(sym, a, 1);                                  \
+                                                                 \
+    lval* x = a->cell[0];                                        \
+    lval* y = a->cell[1];                                        \
+    int r;                                                       \
+    if (x->type == LVAL_NUM && y->type == LVAL_NUM) {            \
+      r = (x->num op y->num);                                    \
+    } else if (x->type == LVAL_DBL || y->type == LVAL_DBL) {     \
+      r = (lval_to_dbl(x) op lval_to_dbl(y));                    \
+    } else {                                                     \
+      r = (lval_num_cmp(x, y) op 0);                             \
+    }                                                            \
+    lval_del(a);                                                 \
+    return lval_num(r);                                          \
+  }
 
-lval* builtin_weak_less(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<=");
-}
+LISB_ORD_OPS(LISB_ORD_BUILTIN)
 
-lval* builtin_if(lenv* e, lval* a) {
+/* get the branch 'if' chooses as an s-expr,
+  lval_eval runs it as a tail call */
+lval* builtin_if_branch(lenv* e, lval* a) {
   LASSERT_NUM_ARGS("if", a, 3);
-  LASSERT_ARG_TYPE("if", a, 0, LVAL_NUM);
+  LASSERT_ARG_NUM("if", a, 0);
   LASSERT_ARG_TYPE("if", a, 1, LVAL_QEXPR);
   LASSERT_ARG_TYPE("if", a, 2, LVAL_QEXPR);
 
-  lval* x;
-
-  if (a->cell[0]->num) {
-    a->cell[1]->type = LVAL_SEXPR;
-    x = lval_eval(e, lval_pop(a, 1));
-  } else {
-    a->cell[2]->type = LVAL_SEXPR;
-    x = lval_eval(e, lval_pop(a, 2));
-  }
+  /* take the chosen branch as an s-expr */
+  int yes = !lval_is_zero(a->cell[0]);
+  lval* x = lval_unshare(lval_pop(a, yes ? 1 : 2));
+  x->type = LVAL_SEXPR;
 
   lval_del(a);
   return x;
 }
 
+lval* builtin_if(lenv* e, lval* a) {
+  lval* x = builtin_if_branch(e, a);
+  if (x->type == LVAL_ERR) { return x; }
+  return lval_eval(e, x);
+}
+
 /* func to define a new lambda func */
 lval* builtin_lambda(lenv* e, lval* a) {
   LASSERT_NUM_ARGS("lambda", a, 2);
@@ -694,7 +2167,10 @@ lval* builtin_lambda(lenv* e, lval* a) {
   lval* body = lval_pop(a, 0);
   lval_del(a);
 
-  return lval_lambda(formals, body);
+  /* the VM compiles the body once, here */
+  lval* f = lval_lambda(formals, body);
+  if (eval_mode == EVAL_VM) { vm_body_code(f, 1); }
+  return f;
 }
 
 /* func to define a new env variable */
@@ -749,6 +2225,20 @@ mpc_parser_t* Expression;
 mpc_parser_t* Lisb;
 lval* lval_read(mpc_ast_t* t);
 
+/* eval each form of a file in turn, printing errors */
+void lval_eval_forms(lenv* e, lval* expr) {
+  /* the forms stay rooted */
+  gc_root_push(expr);
+  while (expr->count) {
+    lval* x = lval_eval(e, lval_pop(expr, 0));
+    if (x->type == LVAL_ERR) { lval_println(x); }
+    lval_del(x);
+    gc_maybe_collect();
+  }
+  gc_root_pop();
+  lval_del(expr);
+}
+
 /* func to load in a _.lisb file */
 lval* builtin_load(lenv* e, lval* a) {
   LASSERT_NUM_ARGS("load", a, 1);
@@ -756,20 +2246,17 @@ lval* builtin_load(lenv* e, lval* a) {
 
   /* parse file matching given string */
   mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Lisb, &r)) {
+  if (mpc_parse_contents(lstr_ptr(&a->cell[0]->str), Lisb, &r)) {
     /* read contents */
     lval* expr = lval_read(r.output);
     mpc_ast_delete(r.output);
 
-    /* eval expressions */
-    while (expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
-      if (x->type == LVAL_ERR) { lval_println(x); }
-      lval_del(x);
-    }
+    /* eval expressions, the file stays rooted */
+    gc_root_push(a);
+    lval_eval_forms(e, expr);
+    gc_root_pop();
 
     /* cleanup and return empty list */
-    lval_del(expr);
     lval_del(a);
     return lval_sexpr();
 
@@ -803,11 +2290,42 @@ lval* builtin_error(lenv* e, lval* a) {
   LASSERT_ARG_TYPE("error", a, 0, LVAL_STR);
 
   /* build a new error from the provided string */
-  lval* err = lval_err(a->cell[0]->str);
+  lval* err = lval_err("%s", lstr_ptr(&a->cell[0]->str));
   lval_del(a);
   return err;
 }
 
+/* func to report garbage collector counters,
+  takes a dummy argument: (gc-stats {}) */
+lval* builtin_gc_stats(lenv* e, lval* a) {
+
+  printf("collections: %li, reclaimed: %li, "
+         "live lvals: %li, live envs: %li, "
+         "lvals allocated: %li, "
+         "next after: %li allocations\n",
+         gc.collections, gc.reclaimed,
+         lval_pool.live, lenv_pool.live,
+         lval_pool.allocs,
+         gc.threshold - (lval_pool.allocs - gc.last_allocs));
+  lval_del(a);
+
+  return lval_sexpr();
+}
+
+/* func to print the lambdas being run, innermost first.
+  Only the --cek evaluator keeps them: (backtrace {}) */
+lval* builtin_backtrace(lenv* e, lval* a) {
+  lval_del(a);
+  if (eval_mode != EVAL_CEK) {
+    return lval_err("backtrace needs the --cek evaluator.");
+  }
+  lval_backtrace();
+  return lval_sexpr();
+}
+
+lval* builtin_ic_stats(lenv* e, lval* a);
+void lvec_add_builtins(lenv* e);
+
 /* add a func to an env */
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
   lval* k = lval_sym(name);
@@ -823,6 +2341,9 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "load", builtin_load);
   lenv_add_builtin(e, "error", builtin_error);
   lenv_add_builtin(e, "print", builtin_print);
+  lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
+  lenv_add_builtin(e, "ic-stats", builtin_ic_stats);
+  lenv_add_builtin(e, "backtrace", builtin_backtrace);
 
   /* list builtins */
   lenv_add_builtin(e, "list", builtin_list);
@@ -851,132 +2372,2950 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "lambda", builtin_lambda);
   lenv_add_builtin(e, "def", builtin_def);
   lenv_add_builtin(e, "=", builtin_put);
+
+  /* vector builtins */
+  lvec_add_builtins(e);
 }
 
-/************************* EVAL FUNCS *************************/
+/************************* VECTORS *************************/
 
-/* handle function calls */
-lval* lval_call(lenv* e, lval* f, lval* a) {
-  /* if a builtin, apply it */
-  if (f->builtin){ return f->builtin(e, a); }
+/* Vectors pack longs or doubles into one array, so numeric
+  work on them doesn't chase a pointer to an lval per
+  element. Each kernel has a plain C version and, where the
+  instructions exist, SSE2 and AVX2 ones, picked once at
+  startup from what the CPU supports (lvec_init).
 
-  int given = a->count;
-  int total = f->formals->count;
-  while (a->count) {
-    /* throw error if given too many args */
-    if (f->formals->count == 0) {
-      lval_del(a);
-      return lval_err("Too many arguments given. "
-                      "Expected %i, given %i.",
-                      total, given);
-    }
-    /* assign next arg to next symbol */
-    lval* sym = lval_pop(f->formals, 0);
+  Integer results that don't fit a long are errors for the
+  elementwise ops, which must make a vector of longs, and
+  bignums for the sums and dot products, as with + and *.
+  Float sums keep four partial sums whatever the kernel, so
+  they come out the same on every CPU.
+*/
 
-    /* deal with & for variable num of args */
-    if (strcmp(sym->sym, "&") == 0) {
-      if(f->formals->count != 1) {
-        lval_del(a);
-        return lval_err("Invalid format: '&' not "
-                        "followed by single symbol.");
-      }
-      lval* next = lval_pop(f->formals, 0);
-      lenv_put(f->env, next, builtin_list(e, a));
-      lval_del(sym);
+/* kernels for one instruction set. The elementwise ones may
+  write over x, and those on longs return 1 on overflow */
+typedef struct lvec_kernels {
+  char* name;
+  void (*add_dbl)(double* r, double* x, double* y, int n);
+  void (*sub_dbl)(double* r, double* x, double* y, int n);
+  void (*mul_dbl)(double* r, double* x, double* y, int n);
+  void (*div_dbl)(double* r, double* x, double* y, int n);
+  int (*add_int)(long* r, long* x, long* y, int n);
+  int (*sub_int)(long* r, long* x, long* y, int n);
+  int (*mul_int)(long* r, long* x, long* y, int n);
+  int (*div_int)(long* r, long* x, long* y, int n);
+  double (*sum_dbl)(double* x, int n);
+  double (*dot_dbl)(double* x, double* y, int n);
+  int (*sum_int)(long* x, int n, long* r);
+  double (*min_dbl)(double* x, int n);
+  double (*max_dbl)(double* x, int n);
+  long (*min_int)(long* x, int n);
+  long (*max_int)(long* x, int n);
+} lvec_kernels;
+
+/* plain C, from the arithmetic table */
+#define LVEC_KERNELS(name, sym, op, flags)                              \
+  void lvec_##name##_dbl(double* r, double* x, double* y, int n) {      \
+    for (int i = 0; i < n; i++) { r[i] = x[i] op y[i]; }                \
+  }                                                                     \
+  int lvec_##name##_int(long* r, long* x, long* y, int n) {             \
+    int over = 0;                                                       \
+    for (int i = 0; i < n; i++) { over |= lnum_##name(x[i], y[i], &r[i]); } \
+    return over;                                                        \
+  }
+
+LISB_ARITH_OPS(LVEC_KERNELS)
+
+/* float sums in four lanes, added up the same way by all kernels */
+double lvec_lanes(double* l, double* x, int i, int n) {
+  double s = (l[0] + l[1]) + (l[2] + l[3]);
+  for (; i < n; i++) { s += x[i]; }
+  return s;
+}
+
+double lvec_sum_dbl(double* x, int n) {
+  double l[4] = { 0, 0, 0, 0 };
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (int j = 0; j < 4; j++) { l[j] += x[i+j]; }
+  }
+  return lvec_lanes(l, x, i, n);
+}
+
+double lvec_dot_dbl(double* x, double* y, int n) {
+  double l[4] = { 0, 0, 0, 0 };
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (int j = 0; j < 4; j++) { l[j] += x[i+j] * y[i+j]; }
+  }
+  double s = (l[0] + l[1]) + (l[2] + l[3]);
+  for (; i < n; i++) { s += x[i] * y[i]; }
+  return s;
+}
+
+int lvec_sum_int(long* x, int n, long* r) {
+  int over = 0;
+  *r = 0;
+  for (int i = 0; i < n; i++) { over |= lnum_add(*r, x[i], r); }
+  return over;
+}
+
+/* dot product of longs, 1 on overflow. No kernel: there is
+  no 64-bit multiply before AVX-512 */
+int lvec_dot_int(long* x, long* y, int n, long* r) {
+  int over = 0;
+  *r = 0;
+  for (int i = 0; i < n; i++) {
+    long p;
+    over |= lnum_mul(x[i], y[i], &p);
+    over |= lnum_add(*r, p, r);
+  }
+  return over;
+}
+
+/* min and max of n > 0 elements */
+double lvec_min_dbl(double* x, int n) {
+  double m = x[0];
+  for (int i = 1; i < n; i++) { m = x[i] < m ? x[i] : m; }
+  return m;
+}
+double lvec_max_dbl(double* x, int n) {
+  double m = x[0];
+  for (int i = 1; i < n; i++) { m = x[i] > m ? x[i] : m; }
+  return m;
+}
+long lvec_min_int(long* x, int n) {
+  long m = x[0];
+  for (int i = 1; i < n; i++) { m = x[i] < m ? x[i] : m; }
+  return m;
+}
+long lvec_max_int(long* x, int n) {
+  long m = x[0];
+  for (int i = 1; i < n; i++) { m = x[i] > m ? x[i] : m; }
+  return m;
+}
+
+const lvec_kernels lvec_scalar = {
+  "scalar",
+  lvec_add_dbl, lvec_sub_dbl, lvec_mul_dbl, lvec_div_dbl,
+  lvec_add_int, lvec_sub_int, lvec_mul_int, lvec_div_int,
+  lvec_sum_dbl, lvec_dot_dbl, lvec_sum_int,
+  lvec_min_dbl, lvec_max_dbl, lvec_min_int, lvec_max_int
+};
+
+#ifdef LISB_SIMD
+
+/* elementwise float ops, W at a time with intrinsics prefix P */
+#define LVEC_SIMD_DBL(name, isa, W, P, TARGET)                          \
+  TARGET void lvec_##name##_dbl_##isa(double* r, double* x, double* y, \
+                                      int n) {                         \
+    int i = 0;                                                         \
+    for (; i + W <= n; i += W) {                                       \
+      P##_storeu_pd(r+i, P##_##name##_pd(P##_loadu_pd(x+i),            \
+                                         P##_loadu_pd(y+i)));          \
+    }                                                                  \
+    lvec_##name##_dbl(r+i, x+i, y+i, n-i);                             \
+  }
+
+#define LVEC_SSE2_DBL(name, sym, op, flags) LVEC_SIMD_DBL(name, sse2, 2, _mm, )
+#define LVEC_AVX2_DBL(name, sym, op, flags)                             \
+  LVEC_SIMD_DBL(name, avx2, 4, _mm256, __attribute__((target("avx2"))))
+
+LISB_ARITH_OPS(LVEC_SSE2_DBL)
+LISB_ARITH_OPS(LVEC_AVX2_DBL)
+
+/* Longs overflowed in s = x + y if (x ^ s) & (y ^ s) has
+  its sign bit set, and in s = x - y if (x ^ y) & (x ^ s)
+  does. The kernels or these together and check at the end */
+
+/* SSE2: two doubles or longs at a time, and two registers
+  for the four float lanes. It has no 64-bit compare, so
+  the min/max of longs are plain C */
+
+int lvec_add_int_sse2(long* r, long* x, long* y, int n) {
+  __m128i o = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((__m128i*) (x+i));
+    __m128i b = _mm_loadu_si128((__m128i*) (y+i));
+    __m128i s = _mm_add_epi64(a, b);
+    o = _mm_or_si128(o, _mm_and_si128(_mm_xor_si128(a, s), _mm_xor_si128(b, s)));
+    _mm_storeu_si128((__m128i*) (r+i), s);
+  }
+  int over = _mm_movemask_pd(_mm_castsi128_pd(o)) != 0;
+  return lvec_add_int(r+i, x+i, y+i, n-i) | over;
+}
+
+int lvec_sub_int_sse2(long* r, long* x, long* y, int n) {
+  __m128i o = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((__m128i*) (x+i));
+    __m128i b = _mm_loadu_si128((__m128i*) (y+i));
+    __m128i s = _mm_sub_epi64(a, b);
+    o = _mm_or_si128(o, _mm_and_si128(_mm_xor_si128(a, b), _mm_xor_si128(a, s)));
+    _mm_storeu_si128((__m128i*) (r+i), s);
+  }
+  int over = _mm_movemask_pd(_mm_castsi128_pd(o)) != 0;
+  return lvec_sub_int(r+i, x+i, y+i, n-i) | over;
+}
+
+double lvec_sum_dbl_sse2(double* x, int n) {
+  __m128d lo = _mm_setzero_pd();
+  __m128d hi = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    lo = _mm_add_pd(lo, _mm_loadu_pd(x+i));
+    hi = _mm_add_pd(hi, _mm_loadu_pd(x+i+2));
+  }
+  double l[4];
+  _mm_storeu_pd(l, lo);
+  _mm_storeu_pd(l+2, hi);
+  return lvec_lanes(l, x, i, n);
+}
+
+double lvec_dot_dbl_sse2(double* x, double* y, int n) {
+  __m128d lo = _mm_setzero_pd();
+  __m128d hi = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    lo = _mm_add_pd(lo, _mm_mul_pd(_mm_loadu_pd(x+i), _mm_loadu_pd(y+i)));
+    hi = _mm_add_pd(hi, _mm_mul_pd(_mm_loadu_pd(x+i+2), _mm_loadu_pd(y+i+2)));
+  }
+  double l[4];
+  _mm_storeu_pd(l, lo);
+  _mm_storeu_pd(l+2, hi);
+  double s = (l[0] + l[1]) + (l[2] + l[3]);
+  for (; i < n; i++) { s += x[i] * y[i]; }
+  return s;
+}
+
+int lvec_sum_int_sse2(long* x, int n, long* r) {
+  __m128i acc = _mm_setzero_si128();
+  __m128i o = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i b = _mm_loadu_si128((__m128i*) (x+i));
+    __m128i s = _mm_add_epi64(acc, b);
+    o = _mm_or_si128(o, _mm_and_si128(_mm_xor_si128(acc, s), _mm_xor_si128(b, s)));
+    acc = s;
+  }
+  long l[2];
+  _mm_storeu_si128((__m128i*) l, acc);
+  int over = _mm_movemask_pd(_mm_castsi128_pd(o)) != 0;
+  over |= lvec_sum_int(x+i, n-i, r);
+  over |= lnum_add(*r, l[0], r);
+  over |= lnum_add(*r, l[1], r);
+  return over;
+}
+
+/* x < m ? x : m per lane, like the plain C loop */
+double lvec_min_dbl_sse2(double* x, int n) {
+  if (n < 2) { return lvec_min_dbl(x, n); }
+  __m128d m = _mm_loadu_pd(x);
+  int i = 2;
+  for (; i + 2 <= n; i += 2) { m = _mm_min_pd(_mm_loadu_pd(x+i), m); }
+  double l[3];
+  _mm_storeu_pd(l, m);
+  l[2] = i < n ? x[i] : l[0];
+  return lvec_min_dbl(l, 3);
+}
+
+double lvec_max_dbl_sse2(double* x, int n) {
+  if (n < 2) { return lvec_max_dbl(x, n); }
+  __m128d m = _mm_loadu_pd(x);
+  int i = 2;
+  for (; i + 2 <= n; i += 2) { m = _mm_max_pd(_mm_loadu_pd(x+i), m); }
+  double l[3];
+  _mm_storeu_pd(l, m);
+  l[2] = i < n ? x[i] : l[0];
+  return lvec_max_dbl(l, 3);
+}
+
+const lvec_kernels lvec_sse2 = {
+  "sse2",
+  lvec_add_dbl_sse2, lvec_sub_dbl_sse2, lvec_mul_dbl_sse2, lvec_div_dbl_sse2,
+  lvec_add_int_sse2, lvec_sub_int_sse2, lvec_mul_int, lvec_div_int,
+  lvec_sum_dbl_sse2, lvec_dot_dbl_sse2, lvec_sum_int_sse2,
+  lvec_min_dbl_sse2, lvec_max_dbl_sse2, lvec_min_int, lvec_max_int
+};
+
+/* AVX2: four at a time, one register for the float lanes */
+#define LVEC_AVX2 __attribute__((target("avx2")))
+
+LVEC_AVX2 int lvec_add_int_avx2(long* r, long* x, long* y, int n) {
+  __m256i o = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*) (x+i));
+    __m256i b = _mm256_loadu_si256((__m256i*) (y+i));
+    __m256i s = _mm256_add_epi64(a, b);
+    o = _mm256_or_si256(o, _mm256_and_si256(_mm256_xor_si256(a, s),
+                                            _mm256_xor_si256(b, s)));
+    _mm256_storeu_si256((__m256i*) (r+i), s);
+  }
+  int over = _mm256_movemask_pd(_mm256_castsi256_pd(o)) != 0;
+  return lvec_add_int(r+i, x+i, y+i, n-i) | over;
+}
+
+LVEC_AVX2 int lvec_sub_int_avx2(long* r, long* x, long* y, int n) {
+  __m256i o = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*) (x+i));
+    __m256i b = _mm256_loadu_si256((__m256i*) (y+i));
+    __m256i s = _mm256_sub_epi64(a, b);
+    o = _mm256_or_si256(o, _mm256_and_si256(_mm256_xor_si256(a, b),
+                                            _mm256_xor_si256(a, s)));
+    _mm256_storeu_si256((__m256i*) (r+i), s);
+  }
+  int over = _mm256_movemask_pd(_mm256_castsi256_pd(o)) != 0;
+  return lvec_sub_int(r+i, x+i, y+i, n-i) | over;
+}
+
+LVEC_AVX2 double lvec_sum_dbl_avx2(double* x, int n) {
+  __m256d acc = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) { acc = _mm256_add_pd(acc, _mm256_loadu_pd(x+i)); }
+  double l[4];
+  _mm256_storeu_pd(l, acc);
+  return lvec_lanes(l, x, i, n);
+}
+
+LVEC_AVX2 double lvec_dot_dbl_avx2(double* x, double* y, int n) {
+  __m256d acc = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_loadu_pd(x+i),
+                                           _mm256_loadu_pd(y+i)));
+  }
+  double l[4];
+  _mm256_storeu_pd(l, acc);
+  double s = (l[0] + l[1]) + (l[2] + l[3]);
+  for (; i < n; i++) { s += x[i] * y[i]; }
+  return s;
+}
+
+LVEC_AVX2 int lvec_sum_int_avx2(long* x, int n, long* r) {
+  __m256i acc = _mm256_setzero_si256();
+  __m256i o = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i b = _mm256_loadu_si256((__m256i*) (x+i));
+    __m256i s = _mm256_add_epi64(acc, b);
+    o = _mm256_or_si256(o, _mm256_and_si256(_mm256_xor_si256(acc, s),
+                                            _mm256_xor_si256(b, s)));
+    acc = s;
+  }
+  long l[4];
+  _mm256_storeu_si256((__m256i*) l, acc);
+  int over = _mm256_movemask_pd(_mm256_castsi256_pd(o)) != 0;
+  over |= lvec_sum_int(x+i, n-i, r);
+  for (int j = 0; j < 4; j++) { over |= lnum_add(*r, l[j], r); }
+  return over;
+}
+
+LVEC_AVX2 double lvec_min_dbl_avx2(double* x, int n) {
+  if (n < 4) { return lvec_min_dbl(x, n); }
+  __m256d m = _mm256_loadu_pd(x);
+  int i = 4;
+  for (; i + 4 <= n; i += 4) { m = _mm256_min_pd(_mm256_loadu_pd(x+i), m); }
+  double l[7];
+  _mm256_storeu_pd(l, m);
+  int k = 4;
+  for (; i < n; i++) { l[k++] = x[i]; }
+  return lvec_min_dbl(l, k);
+}
+
+LVEC_AVX2 double lvec_max_dbl_avx2(double* x, int n) {
+  if (n < 4) { return lvec_max_dbl(x, n); }
+  __m256d m = _mm256_loadu_pd(x);
+  int i = 4;
+  for (; i + 4 <= n; i += 4) { m = _mm256_max_pd(_mm256_loadu_pd(x+i), m); }
+  double l[7];
+  _mm256_storeu_pd(l, m);
+  int k = 4;
+  for (; i < n; i++) { l[k++] = x[i]; }
+  return lvec_max_dbl(l, k);
+}
+
+/* min/max of longs by compare and blend */
+LVEC_AVX2 long lvec_min_int_avx2(long* x, int n) {
+  if (n < 4) { return lvec_min_int(x, n); }
+  __m256i m = _mm256_loadu_si256((__m256i*) x);
+  int i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((__m256i*) (x+i));
+    m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(m, v));
+  }
+  long l[7];
+  _mm256_storeu_si256((__m256i*) l, m);
+  int k = 4;
+  for (; i < n; i++) { l[k++] = x[i]; }
+  return lvec_min_int(l, k);
+}
+
+LVEC_AVX2 long lvec_max_int_avx2(long* x, int n) {
+  if (n < 4) { return lvec_max_int(x, n); }
+  __m256i m = _mm256_loadu_si256((__m256i*) x);
+  int i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((__m256i*) (x+i));
+    m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(v, m));
+  }
+  long l[7];
+  _mm256_storeu_si256((__m256i*) l, m);
+  int k = 4;
+  for (; i < n; i++) { l[k++] = x[i]; }
+  return lvec_max_int(l, k);
+}
+
+const lvec_kernels lvec_avx2 = {
+  "avx2",
+  lvec_add_dbl_avx2, lvec_sub_dbl_avx2, lvec_mul_dbl_avx2, lvec_div_dbl_avx2,
+  lvec_add_int_avx2, lvec_sub_int_avx2, lvec_mul_int, lvec_div_int,
+  lvec_sum_dbl_avx2, lvec_dot_dbl_avx2, lvec_sum_int_avx2,
+  lvec_min_dbl_avx2, lvec_max_dbl_avx2, lvec_min_int_avx2, lvec_max_int_avx2
+};
+
+#endif
+
+/* the kernels in use */
+const lvec_kernels* lvec_kern = &lvec_scalar;
+
+void lvec_init(void) {
+#ifdef LISB_SIMD
+  __builtin_cpu_init();
+  lvec_kern = __builtin_cpu_supports("avx2") ? &lvec_avx2 : &lvec_sse2;
+#endif
+}
+
+/* the elements of v as doubles: its own array,
+  or a converted copy to be freed */
+double* lvec_dbls(lvec* v) {
+  if (v->dbl) { return v->data; }
+  double* d = malloc(sizeof(double) * (v->len ? v->len : 1));
+  for (int i = 0; i < v->len; i++) { d[i] = ((long*) v->data)[i]; }
+  return d;
+}
+
+/* does v have a 0 element */
+int lvec_has_zero(lvec* v) {
+  for (int i = 0; i < v->len; i++) {
+    if (v->dbl ? ((double*) v->data)[i] == 0 : ((long*) v->data)[i] == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* the vector for an elementwise op over a to write to:
+  its first argument if nothing else holds it */
+lval* lvec_result(lval* a, int dbl) {
+  lval* x = a->cell[0];
+  if (a->refs == 1 && !a->base && x->refs == 1 && x->vec.dbl == dbl) {
+    return lval_copy(x);
+  }
+  return lval_vec(dbl, x->vec.len);
+}
+
+/* sum of x[i], times y[i] if y, in bignums */
+lval* lvec_big_sum(long* x, long* y, int n) {
+  lbig r = { 0, 0, NULL };
+  for (int i = 0; i < n; i++) {
+    unsigned long xl, yl;
+    lbig t = lbig_of(x[i], &xl);
+    lbig p = t;
+    if (y) {
+      lbig yb = lbig_of(y[i], &yl);
+      lbig_mul(&p, &t, &yb);
+    }
+    lbig_add(&t, &r, &p);
+    if (y) { free(p.limbs); }
+    free(r.limbs);
+    r = t;
+  }
+  return lval_big(r);
+}
+
+/* make a vector from a q-expr of numbers, of
+  doubles if any is a float, otherwise of longs */
+lval* builtin_vec(lenv* e, lval* a) {
+  LASSERT_NUM_ARGS("vec", a, 1);
+  LASSERT_ARG_TYPE("vec", a, 0, LVAL_QEXPR);
+
+  lval* q = a->cell[0];
+  int dbl = 0;
+  for (int i = 0; i < q->count; i++) {
+    int t = q->cell[i]->type;
+    LASSERT(a, t == LVAL_NUM || t == LVAL_DBL,
+            "'vec' passed incorrect type for element %i. "
+            "Expected %s or %s, got %s.",
+            i, ltype_name(LVAL_NUM), ltype_name(LVAL_DBL), ltype_name(t));
+    dbl = dbl || t == LVAL_DBL;
+  }
+
+  lval* v = lval_vec(dbl, q->count);
+  for (int i = 0; i < q->count; i++) {
+    if (dbl) { ((double*) v->vec.data)[i] = lval_to_dbl(q->cell[i]); }
+    else { ((long*) v->vec.data)[i] = q->cell[i]->num; }
+  }
+  lval_del(a);
+  return v;
+}
+
+/* the elements of a vector as a q-expr */
+lval* builtin_vec_list(lenv* e, lval* a) {
+  LASSERT_NUM_ARGS("vec-list", a, 1);
+  LASSERT_ARG_TYPE("vec-list", a, 0, LVAL_VEC);
+
+  lvec* v = &a->cell[0]->vec;
+  lval* q = lval_qexpr_sized(v->len);
+  for (int i = 0; i < v->len; i++) {
+    lval_add(q, v->dbl ? lval_dbl(((double*) v->data)[i])
+                       : lval_num(((long*) v->data)[i]));
+  }
+  lval_del(a);
+  return q;
+}
+
+/* elementwise arithmetic on two vectors of the same length */
+#define LVEC_ARITH_BUILTIN(name, sym, op, flags)                        \
+  lval* builtin_vec_##name(lenv* e, lval* a) {                          \
+    LASSERT_NUM_ARGS("vec" sym, a, 2);                                  \
+    LASSERT_ARG_TYPE("vec" sym, a, 0, LVAL_VEC);                        \
+    LASSERT_ARG_TYPE("vec" sym, a, 1, LVAL_VEC);                        \
+    lvec* x = &a->cell[0]->vec;                                         \
+    lvec* y = &a->cell[1]->vec;                                         \
+    LASSERT(a, x->len == y->len,                                        \
+            "'%s' passed vectors of lengths %i and %i.",                \
+            "vec" sym, x->len, y->len);                                 \
+    LASSERT(a, !((flags) & ARITH_NONZERO) || !lvec_has_zero(y),         \
+            "Division by zero");                                        \
+                                                                        \
+    int dbl = x->dbl || y->dbl;                                         \
+    lval* r = lvec_result(a, dbl);                                      \
+    if (dbl) {                                                          \
+      double* xd = lvec_dbls(x);                                        \
+      double* yd = lvec_dbls(y);                                        \
+      lvec_kern->name##_dbl(r->vec.data, xd, yd, x->len);               \
+      if (xd != x->data) { free(xd); }                                  \
+      if (yd != y->data) { free(yd); }                                  \
+    } else if (lvec_kern->name##_int(r->vec.data, x->data, y->data,     \
+                                     x->len)) {                         \
+      lval_del(r);                                                      \
+      lval_del(a);                                                      \
+      return lval_err("'%s' result too big for a vector of longs.",     \
+                      "vec" sym);                                       \
+    }                                                                   \
+    lval_del(a);                                                        \
+    return r;                                                           \
+  }
+
+LISB_ARITH_OPS(LVEC_ARITH_BUILTIN)
+
+lval* builtin_vec_sum(lenv* e, lval* a) {
+  LASSERT_NUM_ARGS("vec-sum", a, 1);
+  LASSERT_ARG_TYPE("vec-sum", a, 0, LVAL_VEC);
+
+  lvec* v = &a->cell[0]->vec;
+  long s;
+  lval* r;
+  if (v->dbl) { r = lval_dbl(lvec_kern->sum_dbl(v->data, v->len)); }
+  else if (lvec_kern->sum_int(v->data, v->len, &s)) {
+    r = lvec_big_sum(v->data, NULL, v->len);
+  } else { r = lval_num(s); }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_vec_dot(lenv* e, lval* a) {
+  LASSERT_NUM_ARGS("vec-dot", a, 2);
+  LASSERT_ARG_TYPE("vec-dot", a, 0, LVAL_VEC);
+  LASSERT_ARG_TYPE("vec-dot", a, 1, LVAL_VEC);
+  lvec* x = &a->cell[0]->vec;
+  lvec* y = &a->cell[1]->vec;
+  LASSERT(a, x->len == y->len,
+          "'vec-dot' passed vectors of lengths %i and %i.", x->len, y->len);
+
+  long s;
+  lval* r;
+  if (x->dbl || y->dbl) {
+    double* xd = lvec_dbls(x);
+    double* yd = lvec_dbls(y);
+    r = lval_dbl(lvec_kern->dot_dbl(xd, yd, x->len));
+    if (xd != x->data) { free(xd); }
+    if (yd != y->data) { free(yd); }
+  } else if (lvec_dot_int(x->data, y->data, x->len, &s)) {
+    r = lvec_big_sum(x->data, y->data, x->len);
+  } else { r = lval_num(s); }
+  lval_del(a);
+  return r;
+}
+
+/* smallest or largest element */
+#define LVEC_EXTREME_BUILTIN(name)                                       \
+  lval* builtin_vec_##name(lenv* e, lval* a) {                           \
+    LASSERT_NUM_ARGS("vec-" #name, a, 1);                                \
+    LASSERT_ARG_TYPE("vec-" #name, a, 0, LVAL_VEC);                      \
+    lvec* v = &a->cell[0]->vec;                                          \
+    LASSERT(a, v->len > 0, "'%s' passed an empty vector.", "vec-" #name); \
+                                                                         \
+    lval* r = v->dbl ? lval_dbl(lvec_kern->name##_dbl(v->data, v->len))  \
+                     : lval_num(lvec_kern->name##_int(v->data, v->len)); \
+    lval_del(a);                                                         \
+    return r;                                                            \
+  }
+
+LVEC_EXTREME_BUILTIN(min)
+LVEC_EXTREME_BUILTIN(max)
+
+#define LVEC_ADD_ARITH(name, sym, op, flags)             \
+  lenv_add_builtin(e, "vec" sym, builtin_vec_##name);
+
+void lvec_add_builtins(lenv* e) {
+  lenv_add_builtin(e, "vec", builtin_vec);
+  lenv_add_builtin(e, "vec-list", builtin_vec_list);
+  LISB_ARITH_OPS(LVEC_ADD_ARITH)
+  lenv_add_builtin(e, "vec-dot", builtin_vec_dot);
+  lenv_add_builtin(e, "vec-sum", builtin_vec_sum);
+  lenv_add_builtin(e, "vec-min", builtin_vec_min);
+  lenv_add_builtin(e, "vec-max", builtin_vec_max);
+}
+
+/************************* EVAL FUNCS *************************/
+
+/* bind args 'a' to the formals of lambda 'f', which must not
+  be shared. Returns NULL once every formal is bound and the
+  body is ready to run, otherwise the result of the call:
+  an error or the partially applied function */
+lval* lval_bind(lenv* e, lval* f, lval* a) {
+  /* args go into the lambda's own env */
+  f->env = lenv_unshare(f->env);
+
+  /* formals are consumed as they are bound */
+  f->formals = lval_unshare(f->formals);
+
+  int given = a->count;
+  int total = f->formals->count;
+  while (a->count) {
+    /* throw error if given too many args */
+    if (f->formals->count == 0) {
+      lval_del(a);
+      return lval_err("Too many arguments given. "
+                      "Expected %i, given %i.",
+                      total, given);
+    }
+    /* assign next arg to next symbol */
+    lval* sym = lval_pop(f->formals, 0);
+
+    /* deal with & for variable num of args */
+    if (sym->sym == sym_amp) {
+      if(f->formals->count != 1) {
+        lval_del(sym);
+        lval_del(a);
+        return lval_err("Invalid format: '&' not "
+                        "followed by single symbol.");
+      }
+      lval* next = lval_pop(f->formals, 0);
+      lenv_put(f->env, next, builtin_list(e, a));
+      lval_del(sym);
       lval_del(next);
       break;
-    }/* end '&' case */
+    }/* end '&' case */
+
+    lval* val = lval_pop(a, 0);
+    lenv_put(f->env, sym, val);
+
+    lval_del(sym);
+    lval_del(val);
+  }
+  lval_del(a);
+
+  /* if only '&' remains, bind to empty list */
+  if ( (f->formals->count > 0) &&
+       (f->formals->cell[0]->sym == sym_amp)
+  ) {
+    if (f->formals->count != 2) {
+      return lval_err("Invalid format: '&' not "
+                      "followed by single symbol.");
+    }
+    lval_del(lval_pop(f->formals, 0));
+    lval* sym = lval_pop(f->formals, 0);
+    lval* val = lval_qexpr();
+    lenv_put(f->env, sym, val);
+    lval_del(sym);
+    lval_del(val);
+  }
+
+  /* check if all formals have been assigned */
+  if (f->formals->count == 0) { return NULL; }
+
+  /* return partially evaluated func */
+  return lval_copy(f);
+}
+
+/* the body of lambda 'f' as an s-expr to evaluate */
+lval* lval_body(lval* f) {
+  lval* x = lval_unshare(lval_copy(f->body));
+  x->type = LVAL_SEXPR;
+  return x;
+}
+
+/* handle function calls */
+lval* lval_call(lenv* e, lval* f, lval* a) {
+  /* if a builtin, apply it */
+  if (f->builtin){ return f->builtin(e, a); }
+
+  lval* x = lval_bind(e, f, a);
+  if (x) { return x; }
+
+  /* evaluate and return */
+  f->env->parent = e;
+  return lval_eval(f->env, lval_body(f));
+}
+
+/* eval the children of an sexpr. Returns the sexpr,
+  or the first error found among its children */
+lval* lval_eval_cells(lenv* e, lval* v) {
+  /* children are replaced by their values */
+  v = lval_unshare(v);
+
+  /* eval children */
+  for (int i = 0; i < v->count; i++) {
+    v->cell[i] = lval_eval(e, v->cell[i]);
+  }
+
+  /* if there are errors, return the first error found */
+  for (int i = 0; i < v->count; i++) {
+    if (v->cell[i]->type == LVAL_ERR) {
+      return lval_take(v, i);
+    }
+  }
+  return v;
+}
+
+/* Special forms. When the tree walker meets an s-expr whose
+  head names 'if', 'def', '=' or 'lambda' and whose quoted
+  operands are literal q-exprs, it skips the general path
+  of copying the s-expr to evaluate every cell in place:
+  'if' evaluates only its condition and carries on with
+  the branch it picks, the others only evaluate their
+  value operands. Any other shape returns NULL and takes
+  the general path, which also reports the errors */
+
+/* (if c {a} {b}): the branch to carry on with as an expr,
+  or an error. A branch of more than one expr is returned as
+  the q-expr itself with *quoted set, to be evaluated as an
+  s-expr. Consumes v unless it returns NULL */
+lval* lval_form_if(lenv* e, lval* v, int* quoted) {
+  if (v->count != 4 || v->cell[2]->type != LVAL_QEXPR ||
+      v->cell[3]->type != LVAL_QEXPR) {
+    return NULL;
+  }
+
+  lval* c = lval_eval(e, lval_copy(v->cell[1]));
+  if (c->type != LVAL_NUM) {
+    lval* a = lval_sexpr_sized(3);
+    a = lval_add(a, c);
+    a = lval_add(a, lval_copy(v->cell[2]));
+    a = lval_add(a, lval_copy(v->cell[3]));
+    lval_del(v);
+    return c->type == LVAL_ERR ? lval_take(a, 0) : builtin_if_branch(e, a);
+  }
+
+  /* a branch of one expr is that expr */
+  lval* x = v->cell[c->num ? 2 : 3];
+  *quoted = x->count != 1;
+  x = lval_copy(x->count == 1 ? x->cell[0] : x);
+  lval_del(c);
+  lval_del(v);
+  return x;
+}
+
+/* (def {syms} vals..), (= {syms} vals..), (lambda {formals}
+  {body}): the result of builtin 'f'. Consumes v unless it
+  returns NULL */
+lval* lval_form(lenv* e, lbuiltin f, lval* v) {
+  int var = f == builtin_def || f == builtin_put;
+  if (!(var && v->cell[1]->type == LVAL_QEXPR) &&
+      !(f == builtin_lambda && v->count == 3 &&
+        v->cell[1]->type == LVAL_QEXPR && v->cell[2]->type == LVAL_QEXPR)) {
+    return NULL;
+  }
+
+  /* quoted operands are passed as they are */
+  lval* a = lval_sexpr_sized(v->count-1);
+  a = lval_add(a, lval_copy(v->cell[1]));
+  for (int i = 2; i < v->count; i++) {
+    lval* x = lval_copy(v->cell[i]);
+    a = lval_add(a, var ? lval_eval(e, x) : x);
+  }
+  lval_del(v);
+
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type == LVAL_ERR) { return lval_take(a, i); }
+  }
+  return f(e, a);
+}
+
+lval* native_call(lenv* e, lval* f, lval* a);
+
+/* eval an expr. The branch 'if' picks, the expr given to
+  'eval' and a lambda's body are tail positions: instead of
+  recursing, the loop carries on with them in place, so
+  tail calls run in constant C stack */
+lval* lval_eval_tree(lenv* e, lval* v) {
+  /* lambda whose env 'e' is, and earlier frames that are
+    still visible through it; all are released at the end */
+  lval* frame = NULL;
+  lval** kept = NULL;
+  int nkept = 0;
+
+  /* v is a branch or body q-expr, to be evaluated as an
+    s-expr. It is only copied if it takes the general path */
+  int quoted = 0;
+
+  gc.depth++;
+  while (1) {
+    /* look up symbols */
+    if (v->type == LVAL_SYM) {
+      lval* x = lenv_get(e, v);
+      lval_del(v);
+      v = x;
+      break;
+    }
+
+    /* everything but sexprs evaluates to itself */
+    if (v->type != LVAL_SEXPR && !quoted) { break; }
+
+    /* special forms */
+    if (v->count > 1 && v->cell[0]->type == LVAL_SYM) {
+      lval* f = lenv_peek(e, v->cell[0]->sym);
+      lval* x = NULL;
+      if (f && f->type == LVAL_FUN && f->builtin == builtin_if) {
+        x = lval_form_if(e, v, &quoted);
+        if (x) {
+          v = x;
+          if (v->type == LVAL_ERR) { break; }
+          continue;
+        }
+      } else if (f && f->type == LVAL_FUN && f->builtin) {
+        x = lval_form(e, f->builtin, v);
+        if (x) {
+          v = x;
+          break;
+        }
+      }
+    }
+
+    if (quoted) {
+      v = lval_unshare(v);
+      v->type = LVAL_SEXPR;
+      quoted = 0;
+    }
+
+    /* eval children, stop at an error or if empty */
+    v = lval_eval_cells(e, v);
+    if (v->type == LVAL_ERR || v->count == 0) { break; }
+
+    /* single expression */
+    if (v->count == 1) {
+      v = lval_take(v, 0);
+      continue;
+    }
+
+    /* first element should be a function */
+    lval* f = lval_pop(v, 0);
+    if (f->type != LVAL_FUN) {
+      lval* err = lval_err(
+        "S-Expression must start with a function. "
+        "Expected %s, got %s.",
+        ltype_name(LVAL_FUN), ltype_name(f->type)
+      );
+      lval_del(f);
+      lval_del(v);
+      v = err;
+      break;
+    }
+
+    /* 'if' and 'eval' carry on with the expr they pick */
+    if (f->builtin == builtin_if || f->builtin == builtin_eval) {
+      v = (f->builtin == builtin_if)
+        ? builtin_if_branch(e, v)
+        : builtin_eval_expr(e, v);
+      lval_del(f);
+      if (v->type == LVAL_ERR) { break; }
+      continue;
+    }
+
+    /* other builtins return their result */
+    if (f->builtin) {
+      v = lval_call(e, f, v);
+      lval_del(f);
+      break;
+    }
+
+    /* lambdas of an --emit-c program may run as C */
+    lval* x = native_call(e, f, v);
+    if (x) {
+      lval_del(f);
+      v = x;
+      break;
+    }
+
+    /* lambdas bind args into their own env, give them a private copy */
+    f = lval_unshare(f);
+    x = lval_bind(e, f, v);
+    if (x) {
+      lval_del(f);
+      v = x;
+      break;
+    }
+
+    /* the body runs in place of the current frame. If the new
+      env hides every binding of that frame, lookups can skip
+      it and it is dropped; otherwise it stays in the chain */
+    if (frame && lenv_shadows(f->env, frame->env)) {
+      f->env->parent = frame->env->parent;
+      lval_del(frame);
+    } else {
+      f->env->parent = e;
+      if (frame) {
+        kept = realloc(kept, sizeof(lval*) * (nkept+1));
+        kept[nkept++] = frame;
+      }
+    }
+    frame = f;
+    e = f->env;
+    v = lval_copy(f->body);
+    quoted = 1;
+  }
+  gc.depth--;
+
+  /* release frames */
+  if (frame) { lval_del(frame); }
+  for (int i = 0; i < nkept; i++) { lval_del(kept[i]); }
+  free(kept);
+
+  return v;
+}
+
+/* Explicit-stack evaluator, picked with --cek. Instead of
+  recursing on the C stack, pending work is kept in frames
+  on a heap allocated continuation stack, so recursion
+  depth is bounded by memory rather than the C stack, and
+  the stack can be walked while running (see backtrace).
+*/
+
+/* continuation frame kinds */
+enum { CEK_ARGS, CEK_CALL };
+
+typedef struct cek_frame {
+  int kind;
+  /* symbol the call was made through, or NULL */
+  char* name;
+
+  /* CEK_ARGS: children of sexpr 'expr' before 'i' are
+    values, child 'i' is being evaluated in 'env' */
+  lenv* env;
+  lval* expr;
+  int i;
+
+  /* CEK_CALL: lambda whose body is running */
+  lval* fun;
+} cek_frame;
+
+/* the continuation stack, shared by nested evaluations */
+struct {
+  int count;
+  int cap;
+  cek_frame* frames;
+} cek;
+
+cek_frame* cek_push(int kind, char* name) {
+  if (cek.count == cek.cap) {
+    cek.cap = cek.cap ? cek.cap * 2 : 64;
+    cek.frames = realloc(cek.frames, sizeof(cek_frame) * cek.cap);
+  }
+  cek_frame* k = &cek.frames[cek.count++];
+  k->kind = kind;
+  k->name = name;
+  return k;
+}
+
+/* eval an expr on the continuation stack */
+lval* lval_eval_cek(lenv* e, lval* v) {
+  /* frames below 'base' belong to an outer evaluation */
+  int base = cek.count;
+  /* is 'v' a value to return, or an expr to eval */
+  int ret = 0;
+
+  gc.depth++;
+  while (1) {
+    if (!ret) {
+      /* look up symbols */
+      if (v->type == LVAL_SYM) {
+        lval* x = lenv_get(e, v);
+        lval_del(v);
+        v = x;
+        ret = 1;
+        continue;
+      }
+
+      /* eval the children of an sexpr in turn */
+      if (v->type == LVAL_SEXPR && v->count) {
+        v = lval_unshare(v);
+        lval* first = v->cell[0];
+        cek_frame* k = cek_push(CEK_ARGS,
+          first->type == LVAL_SYM ? first->sym : NULL);
+        k->env = e;
+        k->expr = v;
+        k->i = 0;
+        v = first;
+        continue;
+      }
+
+      /* everything else is a value */
+      ret = 1;
+    }
+
+    /* return 'v' to the innermost frame */
+    if (cek.count == base) { break; }
+    cek_frame* k = &cek.frames[cek.count-1];
+
+    /* a lambda's body is done, release it */
+    if (k->kind == CEK_CALL) {
+      lval_del(k->fun);
+      cek.count--;
+      continue;
+    }
+
+    /* store the child's value, stop at an error */
+    lval* x = k->expr;
+    x->cell[k->i] = v;
+    if (v->type == LVAL_ERR) {
+      cek.count--;
+      v = lval_take(x, k->i);
+      continue;
+    }
+
+    /* move on to the next child */
+    if (++k->i < x->count) {
+      e = k->env;
+      v = x->cell[k->i];
+      ret = 0;
+      continue;
+    }
+
+    /* every child is a value, apply */
+    char* name = k->name;
+    e = k->env;
+    v = x;
+    cek.count--;
+
+    /* single expression */
+    if (v->count == 1) {
+      v = lval_take(v, 0);
+      ret = 0;
+      continue;
+    }
+
+    /* first element should be a function */
+    lval* f = lval_pop(v, 0);
+    if (f->type != LVAL_FUN) {
+      lval* err = lval_err(
+        "S-Expression must start with a function. "
+        "Expected %s, got %s.",
+        ltype_name(LVAL_FUN), ltype_name(f->type)
+      );
+      lval_del(f);
+      lval_del(v);
+      v = err;
+      continue;
+    }
+
+    /* 'if' and 'eval' carry on with the expr they pick */
+    if (f->builtin == builtin_if || f->builtin == builtin_eval) {
+      v = (f->builtin == builtin_if)
+        ? builtin_if_branch(e, v)
+        : builtin_eval_expr(e, v);
+      lval_del(f);
+      ret = (v->type == LVAL_ERR);
+      continue;
+    }
+
+    /* other builtins return their result */
+    if (f->builtin) {
+      v = f->builtin(e, v);
+      lval_del(f);
+      continue;
+    }
+
+    /* lambdas bind args into their own env, give them a private copy */
+    f = lval_unshare(f);
+    x = lval_bind(e, f, v);
+    if (x) {
+      lval_del(f);
+      v = x;
+      continue;
+    }
+
+    /* a call in tail position replaces the running lambda's
+      frame when it hides all its bindings, like lval_eval_tree */
+    k = (cek.count > base) ? &cek.frames[cek.count-1] : NULL;
+    if (k && k->kind == CEK_CALL && lenv_shadows(f->env, k->fun->env)) {
+      f->env->parent = k->fun->env->parent;
+      lval_del(k->fun);
+    } else {
+      f->env->parent = e;
+      k = cek_push(CEK_CALL, NULL);
+    }
+    k->name = name;
+    k->fun = f;
+
+    /* run the body */
+    e = f->env;
+    v = lval_body(f);
+    ret = 0;
+  }
+  gc.depth--;
+
+  return v;
+}
+
+/* print the lambdas running on the continuation stack,
+  innermost first */
+void lval_backtrace(void) {
+  int n = 0;
+  for (int i = cek.count-1; i >= 0; i--) {
+    cek_frame* k = &cek.frames[i];
+    if (k->kind != CEK_CALL) { continue; }
+    printf("  #%i %s\n", n++, k->name ? k->name : "<lambda>");
+  }
+}
+
+
+/************************* VM *************************/
+
+/* Bytecode VM, picked with --vm. An expr is compiled to a
+  flat array of ops working on a value stack, and lambda
+  calls push frames instead of recursing in C. A lambda
+  body is compiled the first time it runs and the code is
+  kept on the body. In a body, the lambda's formals are
+  read from their env slots; any other symbol is looked
+  up by name, as scoping is dynamic.
+*/
+
+/* ops, followed by their operands */
+enum {
+  OP_CONST,     /* k: push constant k */
+  OP_ERR,       /* k: fail with error constant k */
+  OP_LOCAL,     /* i: push the value in env slot i */
+  OP_GLOBAL,    /* k ic: push the value of free symbol constant k */
+  OP_CALL,      /* n: eval the top n values as an s-expr */
+  OP_BINOP,     /* b k ic: apply free symbol k, likely binop b, to
+                   the top 2 values */
+  OP_TAILCALL,  /* n: the same as OP_CALL, as the last thing code does */
+  OP_IF,        /* else slow k ic: run a branch of a literal 'if',
+                   k, on the condition on top */
+  OP_JUMP,      /* to: carry on at op 'to' */
+  OP_RET,       /* return the top value */
+  OP_COUNT
+};
+
+/* number of operands of each op */
+const int op_args[OP_COUNT] = { 1, 1, 1, 2, 1, 3, 1, 4, 1, 0 };
+
+/* builtins with a fast path for two numbers */
+enum { BIN_ADD, BIN_SUB, BIN_MUL, BIN_DIV, BIN_EQ, BIN_NE,
+       BIN_GT, BIN_LT, BIN_GE, BIN_LE, BIN_COUNT };
+
+const lbuiltin vm_binops[BIN_COUNT] = {
+  builtin_add, builtin_sub, builtin_mul, builtin_div,
+  builtin_eq, builtin_ne, builtin_greater, builtin_less,
+  builtin_weak_greater, builtin_weak_less
+};
+char* vm_binop_names[BIN_COUNT] = {
+  "+", "-", "*", "/", "==", "!=", ">", "<", ">=", "<="
+};
+
+/* the names interned, to compare symbols against */
+char* vm_binop_syms[BIN_COUNT];
+
+void vm_binop_init(void) {
+  for (int i = 0; i < BIN_COUNT; i++) {
+    vm_binop_syms[i] = sym_intern(vm_binop_names[i]);
+  }
+}
+
+/* binop interned symbol 'sym' names, or -1 */
+int vm_binop_sym(char* sym) {
+  for (int i = 0; i < BIN_COUNT; i++) {
+    if (vm_binop_syms[i] == sym) { return i; }
+  }
+  return -1;
+}
+
+/* binop a builtin is, or -1 */
+int vm_binop_find(lbuiltin f) {
+  for (int i = 0; i < BIN_COUNT; i++) {
+    if (vm_binops[i] == f) { return i; }
+  }
+  return -1;
+}
+
+/* apply binop b to two numbers, returns 0 if the
+  builtin has to be called instead (division by zero,
+  or overflow into a bignum) */
+int vm_binop(int b, long x, long y, long* r) {
+  switch (b) {
+    case BIN_ADD: return !lnum_add(x, y, r);
+    case BIN_SUB: return !lnum_sub(x, y, r);
+    case BIN_MUL: return !lnum_mul(x, y, r);
+    case BIN_DIV: return y != 0 && !lnum_div(x, y, r);
+    case BIN_EQ: *r = (x == y); return 1;
+    case BIN_NE: *r = (x != y); return 1;
+    case BIN_GT: *r = (x > y); return 1;
+    case BIN_LT: *r = (x < y); return 1;
+    case BIN_GE: *r = (x >= y); return 1;
+    case BIN_LE: *r = (x <= y); return 1;
+  }
+  return 0;
+}
+
+/* apply binop b to doubles: returns 1 for a double in *r,
+  2 for a comparison's 0 or 1 in *c, or 0 if the builtin
+  has to be called instead */
+int vm_binop_dbl(int b, double x, double y, double* r, long* c) {
+  switch (b) {
+    case BIN_ADD: *r = x + y; return 1;
+    case BIN_SUB: *r = x - y; return 1;
+    case BIN_MUL: *r = x * y; return 1;
+    case BIN_DIV: *r = x / y; return y != 0;
+    case BIN_EQ: *c = (x == y); return 2;
+    case BIN_NE: *c = (x != y); return 2;
+    case BIN_GT: *c = (x > y); return 2;
+    case BIN_LT: *c = (x < y); return 2;
+    case BIN_GE: *c = (x >= y); return 2;
+    case BIN_LE: *c = (x <= y); return 2;
+  }
+  return 0;
+}
+
+/* apply binop b to values x and y, taking them, or return
+  NULL to leave them to the builtin. A float result goes in
+  a float operand nothing else holds, so float arithmetic
+  on intermediate results allocates nothing */
+lval* vm_binop_val(int b, lval* x, lval* y) {
+  long r;
+  if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+    if (!vm_binop(b, x->num, y->num, &r)) { return NULL; }
+    lval_del(y);
+    lval_del(x);
+    return lval_num(r);
+  }
+
+  /* a float and a float or long */
+  int xd = x->type == LVAL_DBL;
+  int yd = y->type == LVAL_DBL;
+  if (!(xd && (yd || y->type == LVAL_NUM)) &&
+      !(yd && x->type == LVAL_NUM)) {
+    return NULL;
+  }
+  double d;
+  int got = vm_binop_dbl(b, lval_to_dbl(x), lval_to_dbl(y), &d, &r);
+  if (!got) { return NULL; }
+  if (got == 2) {
+    lval_del(y);
+    lval_del(x);
+    return lval_num(r);
+  }
+
+  lval* v;
+  if (xd && x->refs == 1) {
+    v = x;
+    lval_del(y);
+  } else if (yd && y->refs == 1) {
+    v = y;
+    lval_del(x);
+  } else {
+    v = lval_dbl(0);
+    lval_del(x);
+    lval_del(y);
+  }
+  v->dbl = d;
+  return v;
+}
+
+/* compiler state */
+typedef struct lcomp {
+  lcode* code;
+  /* values on the stack at this point */
+  int sp;
+} lcomp;
+
+/* append an int to the code, returns where it went */
+int lcomp_emit(lcomp* c, int x) {
+  lcode* k = c->code;
+  if (k->count == k->cap) {
+    k->cap = k->cap ? k->cap * 2 : 16;
+    k->ops = realloc(k->ops, sizeof(int) * k->cap);
+  }
+  k->ops[k->count] = x;
+  return k->count++;
+}
+
+/* account for n values pushed */
+void lcomp_push(lcomp* c, int n) {
+  c->sp += n;
+  if (c->sp > c->code->depth) { c->code->depth = c->sp; }
+}
+
+/* add a constant, returns its index */
+int lcomp_const(lcomp* c, lval* v) {
+  lcode* k = c->code;
+  k->consts = realloc(k->consts, sizeof(lval*) * (k->nconsts+1));
+  k->consts[k->nconsts] = lval_copy(v);
+  return k->nconsts++;
+}
+
+/* add an inline cache, returns its index */
+int lcomp_ic(lcomp* c) {
+  lcode* k = c->code;
+  k->ics = realloc(k->ics, sizeof(lic) * (k->nics+1));
+  k->ics[k->nics].val = NULL;
+  return k->nics++;
+}
+
+/* emit the operands of a global lookup of symbol 'x' */
+void lcomp_global(lcomp* c, lval* x) {
+  lcomp_emit(c, lcomp_const(c, x));
+  lcomp_emit(c, lcomp_ic(c));
+}
+
+/* env slot holding formal 'sym', or -1 */
+int lcomp_slot(lcomp* c, char* sym) {
+  lval* f = c->code->formals;
+  if (!f) { return -1; }
+  for (int i = 0; i < f->count; i++) {
+    if (f->cell[i]->sym == sym) { return i; }
+  }
+  return -1;
+}
+
+/* can formals 'f' be read from slots: binding them
+  in order must put formal i in slot i */
+int lcomp_slots_ok(lval* f) {
+  for (int i = 0; i < f->count; i++) {
+    if (f->cell[i]->sym == sym_amp) { return 0; }
+    for (int j = 0; j < i; j++) {
+      if (f->cell[j]->sym == f->cell[i]->sym) { return 0; }
+    }
+  }
+  return 1;
+}
+
+void lcomp_expr(lcomp* c, lval* x, int tail);
+void lcomp_if(lcomp* c, lval* x, int tail);
+
+/* binop that (sym a b) names, if sym is not a formal */
+int lcomp_binop(lcomp* c, lval* x) {
+  if (x->count != 3 || x->cell[0]->type != LVAL_SYM) { return -1; }
+  if (lcomp_slot(c, x->cell[0]->sym) != -1) { return -1; }
+  return vm_binop_sym(x->cell[0]->sym);
+}
+
+/* compile the cells of list 'x' as an s-expr. 'tail' when
+  its value is what the code returns */
+void lcomp_sexpr(lcomp* c, lval* x, int tail) {
+  /* an empty s-expr is its own value */
+  if (x->count == 0) {
+    lval* empty = lval_sexpr();
+    lcomp_emit(c, OP_CONST);
+    lcomp_emit(c, lcomp_const(c, empty));
+    lcomp_push(c, 1);
+    lval_del(empty);
+    return;
+  }
+
+  /* 'if' with literal branches */
+  if (x->count == 4 &&
+      x->cell[0]->type == LVAL_SYM && x->cell[0]->sym == sym_if &&
+      x->cell[2]->type == LVAL_QEXPR && x->cell[3]->type == LVAL_QEXPR) {
+    lcomp_if(c, x, tail);
+    return;
+  }
+
+  /* binops push only their args, the op looks the head up */
+  int b = lcomp_binop(c, x);
+  if (b != -1) {
+    lcomp_expr(c, x->cell[1], 0);
+    lcomp_expr(c, x->cell[2], 0);
+    lcomp_push(c, 1);
+    c->sp -= 2;
+    lcomp_emit(c, OP_BINOP);
+    lcomp_emit(c, b);
+    lcomp_global(c, x->cell[0]);
+    return;
+  }
+
+  /* push every cell, then apply */
+  for (int i = 0; i < x->count; i++) {
+    lcomp_expr(c, x->cell[i], 0);
+  }
+  lcomp_emit(c, tail ? OP_TAILCALL : OP_CALL);
+  lcomp_emit(c, x->count);
+  c->sp -= x->count - 1;
+}
+
+/* compile (if cond {then} {else}) to run the branch inline
+  while 'if' is the builtin, and as a plain call otherwise */
+void lcomp_if(lcomp* c, lval* x, int tail) {
+  lcomp_expr(c, x->cell[1], 0);
+  lcomp_push(c, 1);
+  c->sp -= 2;
+  lcomp_emit(c, OP_IF);
+  int at = lcomp_emit(c, 0);
+  lcomp_emit(c, 0);
+  lcomp_global(c, x->cell[0]);
+
+  /* each branch returns, or jumps past the rest */
+  int ends[2];
+  for (int i = 0; i < 2; i++) {
+    if (i == 1) { c->code->ops[at] = c->code->count; }
+    lcomp_sexpr(c, x->cell[2+i], tail);
+    c->sp--;
+    lcomp_emit(c, tail ? OP_RET : OP_JUMP);
+    ends[i] = tail ? -1 : lcomp_emit(c, 0);
+  }
+
+  /* the slow way, 'if' and the condition are still pushed */
+  c->code->ops[at+1] = c->code->count;
+  c->sp += 2;
+  lcomp_expr(c, x->cell[2], 0);
+  lcomp_expr(c, x->cell[3], 0);
+  lcomp_emit(c, tail ? OP_TAILCALL : OP_CALL);
+  lcomp_emit(c, 4);
+  c->sp -= 3;
+
+  for (int i = 0; i < 2; i++) {
+    if (ends[i] != -1) { c->code->ops[ends[i]] = c->code->count; }
+  }
+}
+
+/* compile an expr */
+void lcomp_expr(lcomp* c, lval* x, int tail) {
+  switch (x->type) {
+    case LVAL_SEXPR:
+      lcomp_sexpr(c, x, tail);
+      return;
+    case LVAL_SYM: {
+      int i = lcomp_slot(c, x->sym);
+      if (i == -1) {
+        lcomp_emit(c, OP_GLOBAL);
+        lcomp_global(c, x);
+      } else {
+        lcomp_emit(c, OP_LOCAL);
+        lcomp_emit(c, i);
+      }
+      break;
+    }
+    case LVAL_ERR:
+      lcomp_emit(c, OP_ERR);
+      lcomp_emit(c, lcomp_const(c, x));
+      break;
+    default:
+      lcomp_emit(c, OP_CONST);
+      lcomp_emit(c, lcomp_const(c, x));
+      break;
+  }
+  lcomp_push(c, 1);
+}
+
+/* compile 'x' to new code. A lambda 'body' is run as an
+  s-expr, and reads 'formals' from slots if given */
+lcode* lcode_compile(lval* x, int body, lval* formals) {
+  lcode* k = calloc(1, sizeof(lcode));
+  k->refs = 1;
+  k->formals = formals ? lval_copy(formals) : NULL;
+
+  lcomp c = { k, 0 };
+  if (body) {
+    lcomp_sexpr(&c, x, 1);
+  } else {
+    lcomp_expr(&c, x, 1);
+  }
+  lcomp_emit(&c, OP_RET);
+  return k;
+}
+
+/* code for the body of lambda 'f'. With 'slots' it reads
+  the formals from their slots if it can */
+lcode* vm_body_code(lval* f, int slots) {
+  lval* body = f->body;
+  lval* key = slots ? f->formals : NULL;
+  if (body->code && body->code->formals == key) { return body->code; }
+
+  if (key && !lcomp_slots_ok(key)) { key = NULL; }
+  if (!body->code || body->code->formals != key) {
+    lval_drop_code(body);
+    body->code = lcode_compile(body, 1, key);
+  }
+  return body->code;
+}
+
+/* a running piece of code */
+typedef struct vm_frame {
+  lcode* code;
+  int pc;
+  lenv* env;
+  /* lambda whose body it is, or NULL */
+  lval* fun;
+} vm_frame;
+
+/* value stack and frames, shared by nested runs */
+struct {
+  int sp;
+  int cap;
+  lval** stack;
+  int nframes;
+  int fcap;
+  vm_frame* frames;
+} vm;
+
+/* make room for n more values */
+void vm_reserve(int n) {
+  if (vm.sp + n <= vm.cap) { return; }
+  vm.cap = (vm.sp + n > vm.cap * 2) ? vm.sp + n : vm.cap * 2;
+  vm.stack = realloc(vm.stack, sizeof(lval*) * vm.cap);
+}
+
+/* start running 'code' in 'e' */
+void vm_push_frame(lcode* code, lenv* e, lval* fun) {
+  if (vm.nframes == vm.fcap) {
+    vm.fcap = vm.fcap ? vm.fcap * 2 : 64;
+    vm.frames = realloc(vm.frames, sizeof(vm_frame) * vm.fcap);
+  }
+  vm_frame* fr = &vm.frames[vm.nframes++];
+  code->refs++;
+  fr->code = code;
+  fr->pc = 0;
+  fr->env = e;
+  fr->fun = fun;
+  vm_reserve(code->depth);
+}
+
+/* end the innermost frame */
+void vm_pop_frame(void) {
+  vm_frame* fr = &vm.frames[--vm.nframes];
+  lcode_del(fr->code);
+  if (fr->fun) { lval_del(fr->fun); }
+}
+
+/* abandon a run at an error: its values and frames
+  are released and the error is its result */
+lval* vm_fail(int sbase, int fbase, lval* err) {
+  while (vm.sp > sbase) { lval_del(vm.stack[--vm.sp]); }
+  while (vm.nframes > fbase) { vm_pop_frame(); }
+  gc.depth--;
+  return err;
+}
+
+/* Each global lookup in code has an inline cache of the
+  value it found and the lenv_version it found it at. The
+  value holds while the version is unchanged and no env
+  but the global one binds the symbol, so a hit skips the
+  lookup, and binops and 'if' also skip copying the head */
+
+struct {
+  long hits;
+  long misses;
+} vm_ic;
+
+/* value of free symbol constant k of code 'c' through
+  inline cache i, not copied, or NULL if unbound */
+lval* vm_lookup(lenv* e, lcode* c, int k, int i) {
+  char* sym = c->consts[k]->sym;
+  lic* ic = &c->ics[i];
+  int global = !sym_info(sym)->locals;
+  if (global && ic->val && ic->version == lenv_version) {
+    vm_ic.hits++;
+    return ic->val;
+  }
+
+  vm_ic.misses++;
+  lval* v = lenv_peek(e, sym);
+  if (global) {
+    ic->val = v;
+    ic->version = lenv_version;
+  }
+  return v;
+}
+
+/* copy of the value vm_lookup found, or an error */
+lval* vm_global(lcode* c, int k, lval* v) {
+  if (!v) { return lval_err("key '%s' not in environment", c->consts[k]->sym); }
+  return lval_copy(v);
+}
+
+lval* builtin_ic_stats(lenv* e, lval* a) {
+  printf("inline cache hits: %li, misses: %li\n", vm_ic.hits, vm_ic.misses);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* move the top n values into an s-expr of args */
+lval* vm_args(int n) {
+  lval* a = lval_sexpr_sized(n);
+  memcpy(a->cell, &vm.stack[vm.sp - n], sizeof(lval*) * n);
+  a->count = n;
+  vm.sp -= n;
+  return a;
+}
+
+/* With GCC or Clang the VM is direct threaded: before code
+  first runs, each opcode is replaced by the offset of its
+  handler from the first one, and each handler jumps
+  straight to the next. Otherwise, or with LISB_NO_THREADED,
+  it loops over a switch. */
+#if defined(__GNUC__) && !defined(LISB_NO_THREADED)
+#define VM_THREADED
+#endif
+
+/* replace the opcodes of 'k' by handler offsets */
+void vm_thread(lcode* k, const int* labels) {
+  int i = 0;
+  while (i < k->count) {
+    int op = k->ops[i];
+    k->ops[i] = labels[op];
+    i += 1 + op_args[op];
+  }
+  k->threaded = 1;
+}
+
+/* run hot numeric lambdas natively, see the JIT */
+int jit_enabled = 0;
+lval* jit_call(lenv* e, lval* f, int n);
+
+/* run 'code' in 'e' to its result */
+lval* vm_run(lenv* e, lcode* code) {
+  int sbase = vm.sp;
+  int fbase = vm.nframes;
+  vm_push_frame(code, e, NULL);
+  gc.depth++;
+
+  /* registers, copied from the innermost frame */
+  vm_frame* fr;
+  int* ops;
+  lval** consts;
+  int pc;
+  int n;
+  int tail;
+
+  #define VM_LOAD()                                 \
+    (fr = &vm.frames[vm.nframes-1], e = fr->env,    \
+     ops = fr->code->ops, consts = fr->code->consts, \
+     pc = fr->pc)
+
+#ifdef VM_THREADED
+  /* handler offsets, by opcode */
+  static const int labels[OP_COUNT] = {
+    &&OP_CONST_L - &&OP_CONST_L,
+    &&OP_ERR_L - &&OP_CONST_L,
+    &&OP_LOCAL_L - &&OP_CONST_L,
+    &&OP_GLOBAL_L - &&OP_CONST_L,
+    &&OP_CALL_L - &&OP_CONST_L,
+    &&OP_BINOP_L - &&OP_CONST_L,
+    &&OP_TAILCALL_L - &&OP_CONST_L,
+    &&OP_IF_L - &&OP_CONST_L,
+    &&OP_JUMP_L - &&OP_CONST_L,
+    &&OP_RET_L - &&OP_CONST_L
+  };
+  #define VM_CASE(op) op##_L
+  #define VM_NEXT() goto *(&&OP_CONST_L + ops[pc++])
+  /* load the innermost frame, which may run new code */
+  #define VM_ENTER()                              \
+    if (!vm.frames[vm.nframes-1].code->threaded) {  \
+      vm_thread(vm.frames[vm.nframes-1].code, labels); \
+    }                                               \
+    VM_LOAD()
+
+  VM_ENTER();
+  VM_NEXT();
+  {
+#else
+  #define VM_CASE(op) case op
+  #define VM_NEXT() continue
+  #define VM_ENTER() VM_LOAD()
+
+  VM_ENTER();
+  while (1) switch (ops[pc++]) {
+#endif
+    VM_CASE(OP_CONST):
+      vm.stack[vm.sp++] = lval_copy(consts[ops[pc++]]);
+      VM_NEXT();
+
+    VM_CASE(OP_ERR):
+      return vm_fail(sbase, fbase, lval_copy(consts[ops[pc]]));
+
+    VM_CASE(OP_LOCAL):
+      vm.stack[vm.sp++] = lval_copy(e->vals[ops[pc++]]);
+      VM_NEXT();
+
+    VM_CASE(OP_GLOBAL): {
+      int k = ops[pc++];
+      lval* x = vm_global(fr->code, k, vm_lookup(e, fr->code, k, ops[pc++]));
+      if (x->type == LVAL_ERR) { return vm_fail(sbase, fbase, x); }
+      vm.stack[vm.sp++] = x;
+      VM_NEXT();
+    }
+
+    VM_CASE(OP_JUMP):
+      pc = ops[pc];
+      VM_NEXT();
+
+    VM_CASE(OP_IF): {
+      /* the condition is on the stack */
+      int k = ops[pc+2];
+      lval* f = vm_lookup(e, fr->code, k, ops[pc+3]);
+      lval* x = vm.stack[vm.sp-1];
+      if (f && f->type == LVAL_FUN && f->builtin == builtin_if &&
+          x->type == LVAL_NUM) {
+        pc = x->num ? pc+4 : ops[pc];
+        lval_del(x);
+        vm.sp--;
+        VM_NEXT();
+      }
+
+      /* otherwise put the head under it for the slow way */
+      f = vm_global(fr->code, k, f);
+      if (f->type == LVAL_ERR) { return vm_fail(sbase, fbase, f); }
+      vm.stack[vm.sp-1] = f;
+      vm.stack[vm.sp++] = x;
+      pc = ops[pc+1];
+      VM_NEXT();
+    }
+
+    VM_CASE(OP_RET): {
+      lval* x = vm.stack[--vm.sp];
+      vm_pop_frame();
+      if (vm.nframes == fbase) {
+        gc.depth--;
+        return x;
+      }
+      VM_LOAD();
+      vm.stack[vm.sp++] = x;
+      VM_NEXT();
+    }
+
+    VM_CASE(OP_BINOP): {
+      /* two numbers need no argument list */
+      lval* x = vm.stack[vm.sp-2];
+      lval* y = vm.stack[vm.sp-1];
+      int b = ops[pc];
+      int k = ops[pc+1];
+      lval* f = vm_lookup(e, fr->code, k, ops[pc+2]);
+      pc += 3;
+      lval* v = f && f->type == LVAL_FUN && f->builtin == vm_binops[b]
+        ? vm_binop_val(b, x, y) : NULL;
+      if (v) {
+        vm.sp -= 2;
+        vm.stack[vm.sp++] = v;
+        VM_NEXT();
+      }
+
+      /* otherwise put the head under the args and call */
+      f = vm_global(fr->code, k, f);
+      if (f->type == LVAL_ERR) { return vm_fail(sbase, fbase, f); }
+      vm.stack[vm.sp-2] = f;
+      vm.stack[vm.sp-1] = x;
+      vm.stack[vm.sp++] = y;
+      n = 3;
+      tail = 0;
+      goto call;
+    }
+
+    VM_CASE(OP_TAILCALL):
+      n = ops[pc++];
+      tail = 1;
+      goto call;
+
+    VM_CASE(OP_CALL):
+      n = ops[pc++];
+      tail = 0;
+    call: {
+      lval* f = vm.stack[vm.sp-n];
+      lval* x;
+
+      /* single expression */
+      if (n == 1) {
+        x = vm.stack[--vm.sp];
+        if (x->type == LVAL_SYM || x->type == LVAL_SEXPR) {
+          fr->pc = pc;
+          x = lval_eval(e, x);
+          fr = &vm.frames[vm.nframes-1];
+        }
+        if (x->type == LVAL_ERR) { return vm_fail(sbase, fbase, x); }
+        vm.stack[vm.sp++] = x;
+        VM_NEXT();
+      }
+
+      /* first element should be a function */
+      if (f->type != LVAL_FUN) {
+        return vm_fail(sbase, fbase, lval_err(
+          "S-Expression must start with a function. "
+          "Expected %s, got %s.",
+          ltype_name(LVAL_FUN), ltype_name(f->type)
+        ));
+      }
+
+      if (f->builtin) {
+        /* two numbers need no argument list */
+        lval* v = n == 3
+          ? vm_binop_val(vm_binop_find(f->builtin), vm.stack[vm.sp-2],
+                         vm.stack[vm.sp-1])
+          : NULL;
+        if (v) {
+          lval_del(f);
+          vm.sp -= 3;
+          vm.stack[vm.sp++] = v;
+          VM_NEXT();
+        }
+
+        lval* args = vm_args(n-1);
+        vm.sp--;
+
+        /* 'if' and 'eval' run the expr they pick as new code */
+        if (f->builtin == builtin_if || f->builtin == builtin_eval) {
+          x = (f->builtin == builtin_if)
+            ? builtin_if_branch(e, args)
+            : builtin_eval_expr(e, args);
+          lval_del(f);
+          if (x->type == LVAL_ERR) { return vm_fail(sbase, fbase, x); }
+
+          lcode* k = lcode_compile(x, 0, NULL);
+          lval_del(x);
+          if (tail) {
+            /* in place of the code that is running */
+            lcode_del(fr->code);
+            fr->code = k;
+            fr->pc = 0;
+            vm_reserve(k->depth);
+          } else {
+            fr->pc = pc;
+            vm_push_frame(k, e, NULL);
+            lcode_del(k);
+          }
+          VM_ENTER();
+          VM_NEXT();
+        }
+
+        /* other builtins return their result */
+        fr->pc = pc;
+        x = f->builtin(e, args);
+        lval_del(f);
+        fr = &vm.frames[vm.nframes-1];
+        if (x->type == LVAL_ERR) { return vm_fail(sbase, fbase, x); }
+        vm.stack[vm.sp++] = x;
+        VM_NEXT();
+      }
+
+      /* hot lambdas of numbers may run as native code */
+      if (jit_enabled && (x = jit_call(e, f, n))) {
+        while (n--) { lval_del(vm.stack[--vm.sp]); }
+        vm.stack[vm.sp++] = x;
+        VM_NEXT();
+      }
+
+      /* lambdas bind args into their own env, give them a private copy */
+      f = lval_unshare(f);
+      vm.stack[vm.sp-n] = f;
+
+      /* given every arg of a fresh lambda, put them straight
+        into their slots, otherwise bind them as lval_call does */
+      lcode* k = NULL;
+      if (f->env->count == 0 && f->formals->count == n-1) {
+        k = vm_body_code(f, 1);
+        if (k->formals != f->formals) { k = NULL; }
+      }
+      if (k) {
+        f->env = lenv_unshare(f->env);
+        for (int i = 1; i < n; i++) {
+          lval* v = vm.stack[vm.sp-n+i];
+          lenv_put(f->env, f->formals->cell[i-1], v);
+          lval_del(v);
+        }
+        vm.sp -= n;
+      } else {
+        lval* args = vm_args(n-1);
+        vm.sp--;
+        x = lval_bind(e, f, args);
+        if (x) {
+          lval_del(f);
+          if (x->type == LVAL_ERR) { return vm_fail(sbase, fbase, x); }
+          vm.stack[vm.sp++] = x;
+          VM_NEXT();
+        }
+        k = vm_body_code(f, 0);
+      }
+
+      /* a call in tail position replaces the running lambda's
+        frame when it hides all its bindings, like lval_eval_tree */
+      if (tail && fr->fun && lenv_shadows(f->env, e)) {
+        f->env->parent = e->parent;
+        k->refs++;
+        lcode_del(fr->code);
+        lval_del(fr->fun);
+        fr->code = k;
+        fr->pc = 0;
+        fr->env = f->env;
+        fr->fun = f;
+        vm_reserve(k->depth);
+      } else {
+        f->env->parent = e;
+        fr->pc = pc;
+        vm_push_frame(k, f->env, f);
+      }
+      VM_ENTER();
+      VM_NEXT();
+    }
+  }
+  #undef VM_LOAD
+  #undef VM_ENTER
+  #undef VM_CASE
+  #undef VM_NEXT
+}
+
+/* eval an expr on the VM */
+lval* lval_eval_vm(lenv* e, lval* v) {
+  /* anything else is its own value */
+  if (v->type != LVAL_SYM && v->type != LVAL_SEXPR) { return v; }
+
+  lcode* k = lcode_compile(v, 0, NULL);
+  lval_del(v);
+  lval* x = vm_run(e, k);
+  lcode_del(k);
+  return x;
+}
+
+/* eval an expr with the chosen evaluator */
+lval* lval_eval(lenv* e, lval* v) {
+  switch (eval_mode) {
+    case EVAL_CEK: return lval_eval_cek(e, v);
+    case EVAL_VM: return lval_eval_vm(e, v);
+    default: return lval_eval_tree(e, v);
+  }
+}
+
+/************************* JIT *************************/
+
+/* Native code for hot lambdas of numbers, with --jit. Once
+  a lambda's body has been called JIT_THRESHOLD times by the
+  VM, a body built only from numbers, its formals, the
+  arithmetic and comparison builtins, 'if' with literal
+  branches and calls to the lambda itself is compiled to
+  x86-64, working on plain longs.
+
+  Native code does not look symbols up. Each call first
+  checks that the symbols it relies on still mean those
+  builtins and the lambda, seen from the caller's env, and
+  that the args are numbers. The code has no side effects,
+  so when it can't carry on (division by zero, overflow into
+  a bignum, recursion too deep) it gives up and the VM runs
+  the call again.
+  Code is listed in /tmp/perf-<pid>.map for perf.
+*/
+
+#define JIT_THRESHOLD 50
+#define JIT_MAX_DEPTH 10000
+#define JIT_MAX_ARGS 6
+#define JIT_MAX_GUARDS 16
+
+typedef long (*ljit_fn)(long* args);
+
+/* compiled lambda body. 'guards' are the symbols it checks
+  at entry and 'expect' what each must be: a builtin, or
+  NULL for the lambda itself */
+struct ljit {
+  ljit_fn fn;
+  size_t size;
+  int nguards;
+  char* guards[JIT_MAX_GUARDS];
+  lbuiltin expect[JIT_MAX_GUARDS];
+};
+
+#ifdef LISB_JIT
+
+/* why native code gave up, set by the code */
+enum { JIT_OK, JIT_DIV_ZERO, JIT_OVERFLOW, JIT_TOO_DEEP };
+long jit_fail;
+long jit_depth;
+
+/* marks a body that can't be compiled */
+ljit jit_none;
+
+/* perf map file */
+FILE* jit_map;
+
+/* places in the code that jump to a label */
+enum { JIT_EXIT, JIT_DEEP, JIT_DIV0, JIT_OVF, JIT_NLABELS };
+
+/* compiler state */
+typedef struct ljitc {
+  unsigned char* buf;
+  int len;
+  int cap;
+  lval* self;
+  lenv* env;
+  ljit* jit;
+  int nfix;
+  int* fix_at;
+  int* fix_to;
+} ljitc;
+
+void jit_emit(ljitc* c, char* bytes, int n) {
+  if (c->len + n > c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 256;
+    c->buf = realloc(c->buf, c->cap);
+  }
+  memcpy(c->buf + c->len, bytes, n);
+  c->len += n;
+}
+void jit_emit32(ljitc* c, int x) { jit_emit(c, (char*) &x, 4); }
+void jit_emit64(ljitc* c, long x) { jit_emit(c, (char*) &x, 8); }
+
+/* emit a jump or call op with a rel32 to fill in,
+  returns where the rel32 is */
+int jit_jump(ljitc* c, char* op, int n) {
+  jit_emit(c, op, n);
+  jit_emit32(c, 0);
+  return c->len - 4;
+}
+void jit_patch(ljitc* c, int at, int to) {
+  int rel = to - (at + 4);
+  memcpy(c->buf + at, &rel, 4);
+}
+
+/* jump to label l once it is placed */
+void jit_jump_to(ljitc* c, char* op, int n, int l) {
+  c->fix_at = realloc(c->fix_at, sizeof(int) * (c->nfix+1));
+  c->fix_to = realloc(c->fix_to, sizeof(int) * (c->nfix+1));
+  c->fix_at[c->nfix] = jit_jump(c, op, n);
+  c->fix_to[c->nfix] = l;
+  c->nfix++;
+}
+
+/* mov r11, &x */
+void jit_addr(ljitc* c, long* x) {
+  jit_emit(c, "\x49\xBB", 2);
+  jit_emit64(c, (long) x);
+}
+
+/* rely on 'sym' being builtin 'f', or the lambda if NULL */
+int jit_guard(ljitc* c, char* sym, lbuiltin f) {
+  ljit* j = c->jit;
+  for (int i = 0; i < j->nguards; i++) {
+    if (j->guards[i] == sym) { return j->expect[i] == f; }
+  }
+  if (j->nguards == JIT_MAX_GUARDS) { return 0; }
+  j->guards[j->nguards] = sym;
+  j->expect[j->nguards] = f;
+  j->nguards++;
+  return 1;
+}
+
+/* is 'v' the lambda being compiled, or a copy of it */
+int jit_is_self(lval* v, lval* f) {
+  return v && v->type == LVAL_FUN && !v->builtin &&
+    v->body == f->body && v->formals == f->formals;
+}
+
+/* formal's slot in the args array, or -1 */
+int jit_slot(ljitc* c, char* sym) {
+  lval* f = c->self->formals;
+  for (int i = 0; i < f->count; i++) {
+    if (f->cell[i]->sym == sym) { return i; }
+  }
+  return -1;
+}
+
+int jit_list(ljitc* c, lval* x);
+
+/* compile an expr, leaving its value in rax. Returns 0
+  if it is not something native code can do */
+int jit_expr(ljitc* c, lval* x) {
+  switch (x->type) {
+    case LVAL_NUM:
+      jit_emit(c, "\x48\xB8", 2);             /* mov rax, imm64 */
+      jit_emit64(c, x->num);
+      return 1;
+    case LVAL_SYM: {
+      int i = jit_slot(c, x->sym);
+      if (i == -1) { return 0; }
+      jit_emit(c, "\x48\x8B\x83", 3);         /* mov rax, [rbx+8i] */
+      jit_emit32(c, 8 * i);
+      return 1;
+    }
+    case LVAL_SEXPR:
+      return jit_list(c, x);
+  }
+  return 0;
+}
+
+/* compile (op x y) for binop b */
+int jit_binop(ljitc* c, lval* x, int b) {
+  if (!jit_guard(c, x->cell[0]->sym, vm_binops[b])) { return 0; }
+  if (!jit_expr(c, x->cell[1])) { return 0; }
+  jit_emit(c, "\x50", 1);                     /* push rax */
+  if (!jit_expr(c, x->cell[2])) { return 0; }
+  jit_emit(c, "\x48\x89\xC1", 3);             /* mov rcx, rax */
+  jit_emit(c, "\x58", 1);                     /* pop rax */
+
+  /* setcc for each comparison */
+  static char setcc[BIN_COUNT] = {
+    0, 0, 0, 0, 0x94, 0x95, 0x9F, 0x9C, 0x9D, 0x9E
+  };
+
+  switch (b) {
+    case BIN_ADD: jit_emit(c, "\x48\x01\xC8", 3); break;     /* add rax, rcx */
+    case BIN_SUB: jit_emit(c, "\x48\x29\xC8", 3); break;     /* sub rax, rcx */
+    case BIN_MUL: jit_emit(c, "\x48\x0F\xAF\xC1", 4); break; /* imul rax, rcx */
+    case BIN_DIV: {
+      jit_emit(c, "\x48\x85\xC9", 3);                        /* test rcx, rcx */
+      jit_jump_to(c, "\x0F\x84", 2, JIT_DIV0);               /* jz div0 */
+      /* idiv traps on LONG_MIN / -1, so negate instead */
+      jit_emit(c, "\x48\x83\xF9\xFF", 4);                    /* cmp rcx, -1 */
+      int to_div = jit_jump(c, "\x0F\x85", 2);              /* jne div */
+      jit_emit(c, "\x48\xF7\xD8", 3);                        /* neg rax */
+      jit_jump_to(c, "\x0F\x80", 2, JIT_OVF);                /* jo ovf */
+      int to_end = jit_jump(c, "\xE9", 1);                   /* jmp end */
+      jit_patch(c, to_div, c->len);
+      jit_emit(c, "\x48\x99", 2);                            /* cqo */
+      jit_emit(c, "\x48\xF7\xF9", 3);                        /* idiv rcx */
+      jit_patch(c, to_end, c->len);
+      break;
+    }
+    default: {
+      char set[3] = { 0x0F, setcc[b], 0xC0 };
+      jit_emit(c, "\x48\x39\xC8", 3);                        /* cmp rax, rcx */
+      jit_emit(c, set, 3);                                   /* setcc al */
+      jit_emit(c, "\x0F\xB6\xC0", 3);                        /* movzx eax, al */
+    }
+  }
 
-    lval* val = lval_pop(a, 0);
-    lenv_put(f->env, sym, val);
+  /* a sum or product too big for a long needs a bignum */
+  if (b == BIN_ADD || b == BIN_SUB || b == BIN_MUL) {
+    jit_jump_to(c, "\x0F\x80", 2, JIT_OVF);                  /* jo ovf */
+  }
+  return 1;
+}
 
-    lval_del(sym);
-    lval_del(val);
+/* compile (if cond {then} {else}) */
+int jit_if(ljitc* c, lval* x) {
+  if (!jit_guard(c, sym_if, builtin_if)) { return 0; }
+  if (!jit_expr(c, x->cell[1])) { return 0; }
+  jit_emit(c, "\x48\x85\xC0", 3);             /* test rax, rax */
+  int to_else = jit_jump(c, "\x0F\x84", 2);   /* jz else */
+  if (!jit_list(c, x->cell[2])) { return 0; }
+  int to_end = jit_jump(c, "\xE9", 1);        /* jmp end */
+  jit_patch(c, to_else, c->len);
+  if (!jit_list(c, x->cell[3])) { return 0; }
+  jit_patch(c, to_end, c->len);
+  return 1;
+}
+
+/* compile a call to the lambda itself */
+int jit_self(ljitc* c, lval* x) {
+  int n = x->count - 1;
+  if (n != c->self->formals->count) { return 0; }
+  if (!jit_guard(c, x->cell[0]->sym, NULL)) { return 0; }
+
+  /* build the args array on the stack */
+  jit_emit(c, "\x48\x81\xEC", 3);             /* sub rsp, 8n */
+  jit_emit32(c, 8 * n);
+  for (int i = 0; i < n; i++) {
+    if (!jit_expr(c, x->cell[i+1])) { return 0; }
+    jit_emit(c, "\x48\x89\x84\x24", 4);       /* mov [rsp+8i], rax */
+    jit_emit32(c, 8 * i);
+  }
+  jit_emit(c, "\x48\x89\xE7", 3);             /* mov rdi, rsp */
+  jit_patch(c, jit_jump(c, "\xE8", 1), 0);    /* call start */
+  jit_emit(c, "\x48\x81\xC4", 3);             /* add rsp, 8n */
+  jit_emit32(c, 8 * n);
+
+  /* stop if it gave up */
+  jit_addr(c, &jit_fail);
+  jit_emit(c, "\x49\x83\x3B\x00", 4);         /* cmp qword [r11], 0 */
+  jit_jump_to(c, "\x0F\x85", 2, JIT_EXIT);    /* jnz exit */
+  return 1;
+}
+
+/* compile the cells of a list as an s-expr */
+int jit_list(ljitc* c, lval* x) {
+  /* single expression */
+  if (x->count == 1) { return jit_expr(c, x->cell[0]); }
+
+  /* otherwise a call through a symbol that is not a formal */
+  if (x->count < 2 || x->cell[0]->type != LVAL_SYM) { return 0; }
+  char* head = x->cell[0]->sym;
+  if (jit_slot(c, head) != -1) { return 0; }
+
+  if (head == sym_if && x->count == 4 &&
+      x->cell[2]->type == LVAL_QEXPR && x->cell[3]->type == LVAL_QEXPR) {
+    return jit_if(c, x);
+  }
+  int b = vm_binop_sym(head);
+  if (x->count == 3 && b != -1) { return jit_binop(c, x, b); }
+  if (jit_is_self(lenv_peek(c->env, head), c->self)) {
+    return jit_self(c, x);
+  }
+  return 0;
+}
+
+/* set jit_fail to 'why' and leave */
+void jit_give_up(ljitc* c, int why) {
+  jit_addr(c, &jit_fail);
+  jit_emit(c, "\x49\xC7\x03", 3);             /* mov qword [r11], why */
+  jit_emit32(c, why);
+  jit_jump_to(c, "\xE9", 1, JIT_EXIT);        /* jmp exit */
+}
+
+/* compile the body of lambda 'f', called from 'e' */
+ljit* jit_compile(lenv* e, lval* f) {
+  ljitc c = { NULL, 0, 0, f, e, calloc(1, sizeof(ljit)), 0, NULL, NULL };
+  int labels[JIT_NLABELS];
+
+  /* prologue: rbx holds the args */
+  jit_emit(&c, "\x55", 1);                    /* push rbp */
+  jit_emit(&c, "\x48\x89\xE5", 3);            /* mov rbp, rsp */
+  jit_emit(&c, "\x53", 1);                    /* push rbx */
+  jit_emit(&c, "\x48\x89\xFB", 3);            /* mov rbx, rdi */
+  jit_addr(&c, &jit_depth);
+  jit_emit(&c, "\x49\x83\x03\x01", 4);        /* add qword [r11], 1 */
+  jit_emit(&c, "\x49\x81\x3B", 3);            /* cmp qword [r11], max */
+  jit_emit32(&c, JIT_MAX_DEPTH);
+  jit_jump_to(&c, "\x0F\x8F", 2, JIT_DEEP);   /* jg deep */
+
+  /* only plain formals, each in its own slot */
+  int ok = f->formals->count <= JIT_MAX_ARGS;
+  for (int i = 0; i < f->formals->count; i++) {
+    if (f->formals->cell[i]->sym == sym_amp) { ok = 0; }
+  }
+  ok = ok && jit_list(&c, f->body);
+
+  /* epilogue */
+  labels[JIT_EXIT] = c.len;
+  jit_addr(&c, &jit_depth);
+  jit_emit(&c, "\x49\x83\x2B\x01", 4);        /* sub qword [r11], 1 */
+  jit_emit(&c, "\x48\x8D\x65\xF8", 4);        /* lea rsp, [rbp-8] */
+  jit_emit(&c, "\x5B\x5D\xC3", 3);            /* pop rbx; pop rbp; ret */
+
+  labels[JIT_DEEP] = c.len;
+  jit_give_up(&c, JIT_TOO_DEEP);
+  labels[JIT_DIV0] = c.len;
+  jit_give_up(&c, JIT_DIV_ZERO);
+  labels[JIT_OVF] = c.len;
+  jit_give_up(&c, JIT_OVERFLOW);
+
+  for (int i = 0; i < c.nfix; i++) {
+    jit_patch(&c, c.fix_at[i], labels[c.fix_to[i]]);
+  }
+  free(c.fix_at);
+  free(c.fix_to);
+
+  /* copy to executable memory */
+  void* mem = MAP_FAILED;
+  if (ok) {
+    mem = mmap(NULL, c.len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (mem == MAP_FAILED) {
+    free(c.buf);
+    free(c.jit);
+    return &jit_none;
+  }
+  memcpy(mem, c.buf, c.len);
+  free(c.buf);
+
+  /* W^X or SELinux policy may refuse to make it executable */
+  if (mprotect(mem, c.len, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, c.len);
+    free(c.jit);
+    return &jit_none;
+  }
+
+  ljit* j = c.jit;
+  j->fn = (ljit_fn) mem;
+  j->size = c.len;
+
+  /* name it after the symbol it calls itself through */
+  char* name = "lambda";
+  for (int i = 0; i < j->nguards; i++) {
+    if (!j->expect[i]) { name = j->guards[i]; }
+  }
+  if (!jit_map) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int) getpid());
+    jit_map = fopen(path, "w");
+  }
+  if (jit_map) {
+    fprintf(jit_map, "%lx %lx lisb:%s\n",
+            (unsigned long) mem, (unsigned long) c.len, name);
+    fflush(jit_map);
+  }
+  return j;
+}
+
+void jit_free(ljit* j) {
+  if (!j || j == &jit_none) { return; }
+  munmap((void*) j->fn, j->size);
+  free(j);
+}
+
+/* close the perf map */
+void jit_cleanup(void) {
+  if (jit_map) { fclose(jit_map); }
+  jit_map = NULL;
+}
+
+/* run lambda 'f' natively on the n-1 args above it on the VM
+  stack if it is hot and can be. Returns NULL to have the
+  VM run it */
+lval* jit_call(lenv* e, lval* f, int n) {
+  lcode* k = f->body->code;
+  if (!k || k->formals != f->formals || f->env->count ||
+      f->formals->count != n-1 || n-1 > JIT_MAX_ARGS) {
+    return NULL;
   }
+
+  /* compile once hot */
+  if (!k->jit) {
+    if (++k->calls < JIT_THRESHOLD) { return NULL; }
+    k->jit = jit_compile(e, f);
+  }
+  ljit* j = k->jit;
+  if (j == &jit_none) { return NULL; }
+
+  /* args must be numbers */
+  long args[JIT_MAX_ARGS];
+  for (int i = 0; i < n-1; i++) {
+    lval* a = vm.stack[vm.sp-n+1+i];
+    if (a->type != LVAL_NUM) { return NULL; }
+    args[i] = a->num;
+  }
+
+  /* symbols must still mean the same */
+  for (int i = 0; i < j->nguards; i++) {
+    lval* v = lenv_peek(e, j->guards[i]);
+    int same = j->expect[i]
+      ? (v && v->type == LVAL_FUN && v->builtin == j->expect[i])
+      : jit_is_self(v, f);
+    if (!same) { return NULL; }
+  }
+
+  jit_fail = JIT_OK;
+  jit_depth = 0;
+  long r = j->fn(args);
+
+  /* too deep for the C stack: leave it to the VM from now on */
+  if (jit_fail == JIT_TOO_DEEP) {
+    jit_free(j);
+    k->jit = &jit_none;
+  }
+  if (jit_fail != JIT_OK) { return NULL; }
+  return lval_num(r);
+}
+
+#else
+
+void jit_free(ljit* j) {}
+void jit_cleanup(void) {}
+lval* jit_call(lenv* e, lval* f, int n) { return NULL; }
+
+#endif
+
+/************************* NATIVE CODE *************************/
+
+/* With --emit-c a file is written out as a C program that
+  runs its forms on the interpreter linked in from lisb.c,
+  as source text. Top level lambdas of numbers, defined
+  with 'def' or 'func' and built only from numbers, their
+  formals, the arithmetic and comparison builtins, 'if'
+  with literal branches and calls to themselves, are also
+  written as C functions over longs, and the tree walker
+  runs those instead of the lambda's body.
+
+  Like the JIT, a call first checks that the symbols the C
+  code stands in for still mean the same from the caller's
+  env and that the args are numbers. Otherwise, or if the
+  C code gives up (division by zero, recursion too deep),
+  the lambda is evaluated as usual.
+*/
+
+#define NATIVE_MAX_ARGS 8
+#define NATIVE_MAX_GUARDS 16
+
+/* C function for a lambda body. It sets *fail to give up
+  on the call, NATIVE_TOO_DEEP also gives up on the lambda */
+typedef long (*lnative_fn)(long* args, int* fail);
+enum { NATIVE_OK, NATIVE_FAIL, NATIVE_TOO_DEEP };
+
+/* a lambda with a C function, see lisb_native. 'expect' is
+  the builtin each guard symbol must be, NULL for the lambda */
+typedef struct lnative {
+  lnative_fn fn;
+  int nguards;
+  char* guards[NATIVE_MAX_GUARDS];
+  lbuiltin expect[NATIVE_MAX_GUARDS];
+  lval* lambda;
+} lnative;
+
+struct {
+  int count;
+  lnative* items;
+} natives;
+
+/* is 'v' lambda 'f', or a copy of it */
+int native_is(lval* v, lval* f) {
+  return v && v->type == LVAL_FUN && !v->builtin &&
+    v->body == f->body && v->formals == f->formals;
+}
+
+/* the native for lambda 'f', if it has one */
+lnative* native_find(lval* f) {
+  for (int i = 0; i < natives.count; i++) {
+    if (native_is(f, natives.items[i].lambda)) { return &natives.items[i]; }
+  }
+  return NULL;
+}
+
+/* call lambda 'f' on args 'a' through its C function, if
+  it has one that can run. Returns NULL to have the lambda
+  evaluated instead, leaving 'a' alone */
+lval* native_call(lenv* e, lval* f, lval* a) {
+  lnative* n = native_find(f);
+  if (!n || !n->fn || f->env->count || a->count != f->formals->count ||
+      a->count > NATIVE_MAX_ARGS) {
+    return NULL;
+  }
+
+  /* args must be numbers and the symbols mean the same */
+  long args[NATIVE_MAX_ARGS];
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type != LVAL_NUM) { return NULL; }
+    args[i] = a->cell[i]->num;
+  }
+  for (int i = 0; i < n->nguards; i++) {
+    lval* v = lenv_peek(e, n->guards[i]);
+    int same = n->expect[i]
+      ? (v && v->type == LVAL_FUN && v->builtin == n->expect[i])
+      : native_is(v, f);
+    if (!same) { return NULL; }
+  }
+
+  int fail = NATIVE_OK;
+  long r = n->fn(args, &fail);
+  if (fail == NATIVE_TOO_DEEP) { n->fn = NULL; }
+  if (fail != NATIVE_OK) { return NULL; }
   lval_del(a);
+  return lval_num(r);
+}
 
-  /* if only '&' remains, bind to empty list */
-  if ( (f->formals->count > 0) &&
-       (strcmp(f->formals->cell[0]->sym, "&") == 0)
-  ) {
-    if (f->formals->count != 2) {
-      return lval_err("Invalid format: '&' not "
-                      "followed by single symbol.");
+void native_mark(void) {
+  for (int i = 0; i < natives.count; i++) {
+    gc_mark_lval(natives.items[i].lambda);
+  }
+}
+
+void native_cleanup(void) {
+  for (int i = 0; i < natives.count; i++) {
+    lval_del(natives.items[i].lambda);
+  }
+  free(natives.items);
+  natives.items = NULL;
+  natives.count = 0;
+}
+
+/* translation state for one lambda */
+typedef struct lemit {
+  FILE* out;
+  char* self;
+  lval** formals;
+  int nformals;
+  int id;
+  /* whether it calls itself in tail position */
+  int loops;
+  int nguards;
+  char* guards[NATIVE_MAX_GUARDS];
+} lemit;
+
+/* write 's' as the inside of a C string */
+void emit_c_str(FILE* out, char* s, int len) {
+  for (int i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') { fprintf(out, "\\%c", c); }
+    else if (c == '\n') { fputs("\\n", out); }
+    else if (c < ' ' || c > '~') { fprintf(out, "\\%03o", c); }
+    else { fputc(c, out); }
+  }
+}
+
+/* C source is built up in memory. Windows has no
+  open_memstream, so there it goes to a temp file that
+  emit_c_close reads back */
+#ifdef _WIN32
+FILE* emit_c_open(char** text, size_t* len) {
+  *text = NULL;
+  *len = 0;
+  return tmpfile();
+}
+
+void emit_c_close(FILE* out, char** text, size_t* len) {
+  *len = ftell(out);
+  *text = malloc(*len + 1);
+  rewind(out);
+  *len = fread(*text, 1, *len, out);
+  (*text)[*len] = '\0';
+  fclose(out);
+}
+#else
+FILE* emit_c_open(char** text, size_t* len) {
+  return open_memstream(text, len);
+}
+
+void emit_c_close(FILE* out, char** text, size_t* len) {
+  fclose(out);
+}
+#endif
+
+/* note that the C code relies on 'sym' */
+int emit_c_guard(lemit* m, char* sym) {
+  for (int i = 0; i < m->nguards; i++) {
+    if (m->guards[i] == sym) { return 1; }
+  }
+  if (m->nguards == NATIVE_MAX_GUARDS) { return 0; }
+  m->guards[m->nguards++] = sym;
+  return 1;
+}
+
+int emit_c_formal(lemit* m, char* sym) {
+  for (int i = 0; i < m->nformals; i++) {
+    if (m->formals[i]->sym == sym) { return i; }
+  }
+  return -1;
+}
+
+int emit_c_list(lemit* m, lval* x);
+char* emit_c_head(lemit* m, lval* x);
+int emit_c_is_if(lval* x, char* head);
+
+/* write 'x' as a C expression, returns 0 if it can't be */
+int emit_c_expr(lemit* m, lval* x) {
+  switch (x->type) {
+    case LVAL_NUM:
+      if (x->num == LONG_MIN) { fprintf(m->out, "(-%ldL-1)", LONG_MAX); }
+      else { fprintf(m->out, "%ldL", x->num); }
+      return 1;
+    case LVAL_SYM: {
+      int i = emit_c_formal(m, x->sym);
+      if (i == -1) { return 0; }
+      fprintf(m->out, "a%i", i);
+      return 1;
     }
-    lval_del(lval_pop(f->formals, 0));
-    lval* sym = lval_pop(f->formals, 0);
-    lval* val = lval_qexpr();
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
+    case LVAL_SEXPR:
+      return emit_c_list(m, x);
   }
+  return 0;
+}
 
-  /* check if all formals have been assigned */
-  if (f->formals->count == 0) {
-    /* evaluate and return */
-    f->env->parent = e;
-    return builtin_eval(f->env,
-                        lval_add( lval_sexpr(),
-                                  lval_copy(f->body)
-                        )
-    );
+/* write the cells of 'x' as an s-expr */
+int emit_c_list(lemit* m, lval* x) {
+  /* single expression */
+  if (x->count == 1) { return emit_c_expr(m, x->cell[0]); }
+
+  /* otherwise a call through a symbol that is not a formal */
+  char* head = emit_c_head(m, x);
+  if (!head) { return 0; }
+
+  if (emit_c_is_if(x, head)) {
+    fputs("(", m->out);
+    int ok = emit_c_expr(m, x->cell[1]);
+    fputs(" ? ", m->out);
+    ok = ok && emit_c_list(m, x->cell[2]);
+    fputs(" : ", m->out);
+    ok = ok && emit_c_list(m, x->cell[3]);
+    fputs(")", m->out);
+    return ok;
+  }
+
+  /* a call to itself */
+  if (head == m->self) {
+    if (x->count-1 != m->nformals) { return 0; }
+    fprintf(m->out, "lisb_fn_%i(", m->id);
+    for (int i = 1; i < x->count; i++) {
+      if (i > 1) { fputs(", ", m->out); }
+      if (!emit_c_expr(m, x->cell[i])) { return 0; }
+    }
+    fputs(")", m->out);
+    return 1;
+  }
+
+  /* binops, as the helpers in emit_c_header */
+  static char* ops[BIN_COUNT] = {
+    "add", "sub", "mul", "div", "eq", "ne", "gt", "lt", "ge", "le"
+  };
+  int b = vm_binop_sym(head);
+  if (x->count == 3 && b != -1) {
+    fprintf(m->out, "lisb_%s(", ops[b]);
+    int ok = emit_c_expr(m, x->cell[1]);
+    fputs(", ", m->out);
+    ok = ok && emit_c_expr(m, x->cell[2]);
+    fputs(")", m->out);
+    return ok;
+  }
+  return 0;
+}
+
+/* if 'x' defines a lambda at the top level, as in (def {name}
+  (lambda {formals} {body})) or (func {name formals} {body})
+  from library.lisb, fill in its parts */
+int emit_c_lambda(lval* x, lemit* m, lval** body) {
+  if (x->type != LVAL_SEXPR || x->count != 3 ||
+      x->cell[0]->type != LVAL_SYM || x->cell[1]->type != LVAL_QEXPR) {
+    return 0;
+  }
+
+  lval* names = x->cell[1];
+  lval* l = x->cell[2];
+  if (strcmp(x->cell[0]->sym, "def") == 0) {
+    if (names->count != 1 || l->type != LVAL_SEXPR || l->count != 3 ||
+        l->cell[0]->type != LVAL_SYM || strcmp(l->cell[0]->sym, "lambda") ||
+        l->cell[1]->type != LVAL_QEXPR || l->cell[2]->type != LVAL_QEXPR) {
+      return 0;
+    }
+    m->formals = l->cell[1]->cell;
+    m->nformals = l->cell[1]->count;
+    *body = l->cell[2];
+  } else if (strcmp(x->cell[0]->sym, "func") == 0) {
+    if (names->count < 1 || l->type != LVAL_QEXPR) { return 0; }
+    m->formals = names->cell + 1;
+    m->nformals = names->count - 1;
+    *body = l;
   } else {
-    /* return partially evaluated func */
-    return lval_copy(f);
+    return 0;
+  }
+
+  if (names->cell[0]->type != LVAL_SYM) { return 0; }
+  m->self = names->cell[0]->sym;
+
+  /* only plain formals */
+  if (m->nformals > NATIVE_MAX_ARGS) { return 0; }
+  for (int i = 0; i < m->nformals; i++) {
+    if (m->formals[i]->type != LVAL_SYM || m->formals[i]->sym == sym_amp) {
+      return 0;
+    }
   }
+  return 1;
 }
 
-/* eval an sexpr */
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-  /* eval children */
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
+/* is 'f' the lambda with the formals and body in 'm' */
+int native_matches(lval* f, lemit* m, lval* body) {
+  if (!f || f->type != LVAL_FUN || f->builtin || f->env->count ||
+      f->formals->count != m->nformals || !lval_eq(f->body, body)) {
+    return 0;
+  }
+  for (int i = 0; i < m->nformals; i++) {
+    if (!lval_eq(f->formals->cell[i], m->formals[i])) { return 0; }
   }
+  return 1;
+}
 
-  /* if there are errors, return the first error found */
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) {
-      return lval_take(v, i);
+/* register C function 'fn' for the lambda defined by form
+  'src', which has just run. The name is only bound to that
+  lambda if the form worked, so it must match what was
+  translated. 'guards' lists the symbols the C code relies
+  on, NULL terminated */
+void lisb_native(lenv* e, char* src, lnative_fn fn, char** guards) {
+  mpc_result_t r;
+  if (!mpc_parse("<native>", src, Lisb, &r)) {
+    mpc_err_delete(r.error);
+    return;
+  }
+  lval* forms = lval_read(r.output);
+  mpc_ast_delete(r.output);
+
+  lemit m = { NULL, NULL, NULL, 0, 0, 0, 0 };
+  lval* body;
+  char* self = NULL;
+  lval* f = NULL;
+  if (forms->count == 1 && emit_c_lambda(forms->cell[0], &m, &body)) {
+    self = sym_intern(m.self);
+    f = lenv_peek(e, self);
+  }
+  if (!native_matches(f, &m, body) || native_find(f)) {
+    lval_del(forms);
+    return;
+  }
+
+  natives.items = realloc(natives.items, sizeof(lnative) * (natives.count+1));
+  lnative* n = &natives.items[natives.count++];
+  n->fn = fn;
+  n->nguards = 0;
+  n->lambda = lval_copy(f);
+
+  for (int i = 0; i < NATIVE_MAX_GUARDS && guards[i]; i++) {
+    char* sym = sym_intern(guards[i]);
+    lbuiltin b = NULL;
+    if (sym == sym_if) { b = builtin_if; }
+    int j = vm_binop_sym(sym);
+    if (j != -1) { b = vm_binops[j]; }
+    n->guards[n->nguards] = sym;
+    n->expect[n->nguards] = sym == self ? NULL : b;
+    n->nguards++;
+  }
+  lval_del(forms);
+}
+
+/* the symbol 'x' calls through, if C code can call it */
+char* emit_c_head(lemit* m, lval* x) {
+  if (x->count < 2 || x->cell[0]->type != LVAL_SYM) { return NULL; }
+  char* head = x->cell[0]->sym;
+  if (emit_c_formal(m, head) != -1 || !emit_c_guard(m, head)) { return NULL; }
+  return head;
+}
+
+/* is 'x' (if c {a} {b}) */
+int emit_c_is_if(lval* x, char* head) {
+  return head == sym_if && x->count == 4 &&
+    x->cell[2]->type == LVAL_QEXPR && x->cell[3]->type == LVAL_QEXPR;
+}
+
+/* write the cells of 'x', in tail position, as statements
+  returning its value. Calls to the lambda itself jump back
+  to the top instead of recursing */
+int emit_c_tail(lemit* m, lval* x, int indent) {
+  FILE* out = m->out;
+  if (x->count == 1 && x->cell[0]->type == LVAL_SEXPR) {
+    return emit_c_tail(m, x->cell[0], indent);
+  }
+
+  char* head = x->count > 1 ? emit_c_head(m, x) : NULL;
+  if (head && emit_c_is_if(x, head)) {
+    fprintf(out, "%*sif (", indent, "");
+    if (!emit_c_expr(m, x->cell[1])) { return 0; }
+    fputs(") {\n", out);
+    if (!emit_c_tail(m, x->cell[2], indent+2)) { return 0; }
+    fprintf(out, "%*s} else {\n", indent, "");
+    if (!emit_c_tail(m, x->cell[3], indent+2)) { return 0; }
+    fprintf(out, "%*s}\n", indent, "");
+    return 1;
+  }
+
+  if (head && head == m->self && x->count-1 == m->nformals) {
+    for (int i = 0; i < m->nformals; i++) {
+      fprintf(out, "%*slong t%i = ", indent, "", i);
+      if (!emit_c_expr(m, x->cell[i+1])) { return 0; }
+      fputs(";\n", out);
     }
+    for (int i = 0; i < m->nformals; i++) {
+      fprintf(out, "%*sa%i = t%i;\n", indent, "", i, i);
+    }
+    fprintf(out, "%*sgoto top;\n", indent, "");
+    m->loops = 1;
+    return 1;
   }
 
-  /* if empty return self */
-  if (v->count == 0) { return v; }
+  fprintf(out, "%*sLISB_RETURN(", indent, "");
+  if (!emit_c_list(m, x)) { return 0; }
+  fputs(");\n", out);
+  return 1;
+}
 
-  /* single expression */
-  if (v->count == 1) {
-    return lval_eval(e, lval_take(v, 0));
-  }
-
-  /* first element should be a function */
-  lval* f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval* err = lval_err(
-      "S-Expression must start with a function. "
-      "Expected %s, got %s.",
-      ltype_name(LVAL_FUN), ltype_name(f->type)
-    );
-    lval_del(f);
-    lval_del(v);
-    return err;
+/* write lambda 'x' as C to m->out, returns 0 if it can't be */
+int emit_c_fn(lemit* m, lval* x) {
+  lval* body;
+  if (!emit_c_lambda(x, m, &body)) { return 0; }
+
+  /* the body first, to know if it loops */
+  char* text = NULL;
+  size_t len;
+  FILE* out = m->out;
+  m->out = emit_c_open(&text, &len);
+  int ok = emit_c_tail(m, body, 2);
+  emit_c_close(m->out, &text, &len);
+  m->out = out;
+  if (!ok) {
+    free(text);
+    return 0;
   }
 
-  /* call function */
-  lval* result = lval_call(e, f, v);
-  lval_del(f);
-  return result;
+  fprintf(out, "/* %s */\nstatic long lisb_fn_%i(", m->self, m->id);
+  for (int i = 0; i < m->nformals; i++) {
+    fprintf(out, "%slong a%i", i ? ", " : "", i);
+  }
+  if (!m->nformals) { fputs("void", out); }
+  fputs(") {\n"
+        "  if (++lisb_depth > LISB_MAX_DEPTH) { lisb_fail = LISB_TOO_DEEP; }\n",
+        out);
+  if (m->loops) { fputs("top:\n", out); }
+  fprintf(out, "  if (lisb_fail) { return 0; }\n%s}\n\n", text);
+  free(text);
+
+  /* called by the runtime with the args in an array */
+  fprintf(out, "static long lisb_entry_%i(long* a, int* fail) {\n"
+               "  lisb_fail = 0;\n"
+               "  lisb_depth = 0;\n"
+               "  long r = lisb_fn_%i(", m->id, m->id);
+  for (int i = 0; i < m->nformals; i++) {
+    fprintf(out, "%sa[%i]", i ? ", " : "", i);
+  }
+  fprintf(out, ");\n"
+               "  *fail = lisb_fail;\n"
+               "  return r;\n"
+               "}\n\n"
+               "static char* lisb_guards_%i[] = { ", m->id);
+  for (int i = 0; i < m->nguards; i++) {
+    fputs("\"", out);
+    emit_c_str(out, m->guards[i], strlen(m->guards[i]));
+    fputs("\", ", out);
+  }
+  fputs("NULL };\n\n", out);
+  return 1;
 }
 
-/* eval an expr */
-lval* lval_eval(lenv* e, lval* v) {
-  /* eval sexprs */
-  if (v->type == LVAL_SYM) {
-    lval* x = lenv_get(e, v);
-    lval_del(v);
-    return x;
+/* runtime the program links against, and what the C
+  functions use if there are any */
+void emit_c_header(FILE* out, char* file, int nfns) {
+  fputs("/* generated by lisb --emit-c from ", out);
+  for (char* c = file; *c; c++) {
+    /* keep the name from closing the comment */
+    if (c[0] == '*' && c[1] == '/') { fputs("* ", out); } else { fputc(*c, out); }
   }
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-  return v;
+  fputs(". Build with:\n"
+    "  cc -O2 -DLISB_NO_MAIN -c lisb.c mpc.c\n"
+    "  cc -O2 this.c lisb.o mpc.o -ledit -lm */\n\n"
+    "#include <stddef.h>\n"
+    "#include <limits.h>\n\n"
+    "typedef struct lenv lenv;\n"
+    "typedef long (*lnative_fn)(long* args, int* fail);\n\n"
+    "lenv* lisb_init(void);\n"
+    "void lisb_run(lenv* e, char* src);\n"
+    "void lisb_native(lenv* e, char* src, lnative_fn fn, char** guards);\n"
+    "void lisb_cleanup(lenv* e);\n\n", out);
+  if (!nfns) { return; }
+
+  fputs("/* as in lisb.c */\n"
+    "#define LISB_FAIL 1\n"
+    "#define LISB_TOO_DEEP 2\n"
+    "#define LISB_MAX_DEPTH 100000\n\n"
+    "static int lisb_fail;\n"
+    "static long lisb_depth;\n\n"
+    "#define LISB_RETURN(x) do { long r = (x); lisb_depth--; return r; } while (0)\n\n"
+    "/* give up on overflow, the interpreter goes on in bignums */\n"
+    "static inline long lisb_add(long x, long y) {\n"
+    "  long r;\n"
+    "  if (__builtin_add_overflow(x, y, &r)) { lisb_fail = LISB_FAIL; }\n"
+    "  return r;\n"
+    "}\n"
+    "static inline long lisb_sub(long x, long y) {\n"
+    "  long r;\n"
+    "  if (__builtin_sub_overflow(x, y, &r)) { lisb_fail = LISB_FAIL; }\n"
+    "  return r;\n"
+    "}\n"
+    "static inline long lisb_mul(long x, long y) {\n"
+    "  long r;\n"
+    "  if (__builtin_mul_overflow(x, y, &r)) { lisb_fail = LISB_FAIL; }\n"
+    "  return r;\n"
+    "}\n"
+    "static inline long lisb_div(long x, long y) {\n"
+    "  if (y == 0 || (y == -1 && x == LONG_MIN)) { lisb_fail = LISB_FAIL; return 0; }\n"
+    "  return x / y;\n"
+    "}\n"
+    "static inline long lisb_eq(long x, long y) { return x == y; }\n"
+    "static inline long lisb_ne(long x, long y) { return x != y; }\n"
+    "static inline long lisb_gt(long x, long y) { return x > y; }\n"
+    "static inline long lisb_lt(long x, long y) { return x < y; }\n"
+    "static inline long lisb_ge(long x, long y) { return x >= y; }\n"
+    "static inline long lisb_le(long x, long y) { return x <= y; }\n\n", out);
+}
+
+/* write the C program for lisb file 'file' to stdout */
+int emit_c_file(char* file) {
+  mpc_result_t r;
+  if (!mpc_parse_contents(file, Lisb, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+  }
+
+  /* source of the file, to cut the forms out of */
+  FILE* in = fopen(file, "rb");
+  if (!in) { mpc_ast_delete(r.output); return 0; }
+  fseek(in, 0, SEEK_END);
+  long size = ftell(in);
+  char* src = malloc(size + 1);
+  fseek(in, 0, SEEK_SET);
+  size = fread(src, 1, size, in);
+  src[size] = '\0';
+  fclose(in);
+
+  /* functions and main are built up separately */
+  char* fns = NULL;
+  char* body = NULL;
+  size_t fns_len, body_len;
+  FILE* fns_out = emit_c_open(&fns, &fns_len);
+  FILE* body_out = emit_c_open(&body, &body_len);
+  int nfns = 0;
+
+  mpc_ast_t* t = r.output;
+  for (int i = 0; i < t->children_num; i++) {
+    mpc_ast_t* c = t->children[i];
+    if (strcmp(c->tag, "regex") == 0 || strstr(c->tag, "comment")) {
+      continue;
+    }
+
+    /* the form runs on the interpreter, as it was written */
+    long from = c->state.pos;
+    long to = i+1 < t->children_num ? t->children[i+1]->state.pos : size;
+    while (to > from && isspace((unsigned char) src[to-1])) { to--; }
+    fputs("  lisb_run(e, \"", body_out);
+    emit_c_str(body_out, src + from, to - from);
+    fputs("\");\n", body_out);
+
+    /* lambdas of numbers also get C functions */
+    char* text = NULL;
+    size_t len;
+    lemit m = { emit_c_open(&text, &len), NULL, NULL, 0, nfns, 0, 0 };
+    lval* x = lval_read(c);
+    int ok = emit_c_fn(&m, x);
+    emit_c_close(m.out, &text, &len);
+    if (ok) {
+      fputs(text, fns_out);
+      fputs("  lisb_native(e, \"", body_out);
+      emit_c_str(body_out, src + from, to - from);
+      fprintf(body_out, "\", lisb_entry_%i, lisb_guards_%i);\n", nfns, nfns);
+      nfns++;
+    }
+    free(text);
+    lval_del(x);
+  }
+  emit_c_close(fns_out, &fns, &fns_len);
+  emit_c_close(body_out, &body, &body_len);
+
+  emit_c_header(stdout, file, nfns);
+  fputs(fns, stdout);
+  printf("int main(int argc, char** argv) {\n"
+         "  lenv* e = lisb_init();\n%s"
+         "  lisb_cleanup(e);\n"
+         "  return 0;\n"
+         "}\n", body);
+
+  free(fns);
+  free(body);
+  free(src);
+  mpc_ast_delete(r.output);
+  return 1;
 }
 
 /************************* READ FUNCS *************************/
@@ -984,23 +5323,40 @@ lval* lval_eval(lenv* e, lval* v) {
 
 /* Create a number lval from an AST leaf */
 lval* lval_read_num(mpc_ast_t* t) {
+  if (strpbrk(t->contents, ".eE")) {
+    return lval_dbl(strtod(t->contents, NULL));
+  }
+
   errno = 0;
   long x = strtol(t->contents, NULL, 10);
   return errno != ERANGE
     ? lval_num(x)
-    : lval_err("Invalid Number.");
+    : lval_big(lbig_read(t->contents));
 }
 
 /* create a string lval from a leaf */
 lval* lval_read_str(mpc_ast_t* t) {
-  /* copy string without quotes */
-  t->contents[strlen(t->contents)-1] = '\0';
-  char* unescaped = malloc(strlen(t->contents+1)+1);
-  strcpy(unescaped, t->contents+1);
-
-  /* unescape and construct the lval */
-  unescaped = mpcf_unescape(unescaped);
-  lval* str = lval_str(unescaped);
+  /* contents without quotes */
+  char* s = t->contents + 1;
+  int n = strlen(s) - 1;
+
+  /* unescape, which only ever shrinks the string */
+  char* unescaped = malloc(n + 1);
+  int len = 0;
+  for (int i = 0; i < n; i++) {
+    char* esc = (s[i] == '\\' && i+1 < n)
+      ? memchr(lstr_esc_code, s[i+1], sizeof(lstr_esc_code))
+      : NULL;
+    if (esc) {
+      unescaped[len++] = lstr_esc_raw[esc - lstr_esc_code];
+      i++;
+    } else {
+      unescaped[len++] = s[i];
+    }
+  }
+
+  /* construct the lval, keeping any NUL bytes */
+  lval* str = lval_str_len(unescaped, len);
   free(unescaped);
   return str;
 }
@@ -1012,11 +5368,12 @@ lval* lval_read(mpc_ast_t* t) {
   if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
   if (strstr(t->tag, "string")) { return lval_read_str(t); }
 
-  /* if root or sexpr create empty list */
+  /* if root or sexpr create empty list, sized for every child */
   lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
-  if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
+  int n = t->children_num;
+  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr_sized(n); }
+  if (strstr(t->tag, "qexpr")) { x = lval_qexpr_sized(n); }
+  if (strstr(t->tag, "sexpr")) { x = lval_sexpr_sized(n); }
 
   /* add valid children */
   for (int i = 0; i < t->children_num; i++) {
@@ -1032,10 +5389,13 @@ lval* lval_read(mpc_ast_t* t) {
   return x;
 }
 
-/************************* MAIN *************************/
+/************************* EMBEDDING *************************/
 
-int main(int argc, char** argv) {
+/* Lisb as a library, for the programs --emit-c writes.
+  Build lisb.c with -DLISB_NO_MAIN to link it in */
 
+/* set up the parsers and a global env with the builtins */
+lenv* lisb_init(void) {
   /* Create parsers */
   Number      = mpc_new("number");
   Symbol      = mpc_new("symbol");
@@ -1048,7 +5408,7 @@ int main(int argc, char** argv) {
 
   /* Define grammar */
   mpca_lang(MPCA_LANG_DEFAULT,
-    " number    : /-?[0-9]+/                        ;\
+    " number    : /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/ ;\
       symbol    : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/  ;\
       string    : /\"(\\\\.|[^\"])*\"/              ;\
       comment   : /;[^\\r\\n]*/                     ;\
@@ -1064,8 +5424,79 @@ int main(int argc, char** argv) {
   );
 
   /* Setup starting env */
+  sym_init();
+  vm_binop_init();
+  lval_num_cache_init();
+  lvec_init();
   lenv* e = lenv_new();
+  gc.global = e;
   lenv_add_builtins(e);
+  return e;
+}
+
+/* eval the forms in 'src', printing errors */
+void lisb_run(lenv* e, char* src) {
+  mpc_result_t r;
+  if (mpc_parse("<native>", src, Lisb, &r)) {
+    lval* expr = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    lval_eval_forms(e, expr);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+}
+
+/* release everything lisb_init set up */
+void lisb_cleanup(lenv* e) {
+  lenv_del(e);
+  native_cleanup();
+  jit_cleanup();
+  free(gc.roots);
+  free(cek.frames);
+  free(vm.stack);
+  free(vm.frames);
+  pool_destroy(&lval_pool);
+  pool_destroy(&lenv_pool);
+  sym_cleanup();
+
+  /* Undefine and Delete parsers */
+  mpc_cleanup(8,
+              Number, Symbol, String, Comment,
+              QExpression, SExpression,
+              Expression, Lisb);
+}
+
+/************************* MAIN *************************/
+
+#ifndef LISB_NO_MAIN
+
+int main(int argc, char** argv) {
+  lenv* e = lisb_init();
+
+  /* pick out switches, leaving the filenames in argv */
+  int emit_c = 0;
+  int nfiles = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--cek") == 0) { eval_mode = EVAL_CEK; }
+    else if (strcmp(argv[i], "--vm") == 0) { eval_mode = EVAL_VM; }
+    else if (strcmp(argv[i], "--jit") == 0) {
+      eval_mode = EVAL_VM;
+      jit_enabled = 1;
+    }
+    else if (strcmp(argv[i], "--emit-c") == 0) { emit_c = 1; }
+    else { argv[++nfiles] = argv[i]; }
+  }
+  argc = nfiles + 1;
+
+  /* translate a file to C on stdout instead of running it */
+  if (emit_c) {
+    int ok = 0;
+    if (argc == 2) { ok = emit_c_file(argv[1]); }
+    else { fputs("usage: lisb --emit-c file.lisb\n", stderr); }
+    lisb_cleanup(e);
+    return !ok;
+  }
 
   /* if no files listed, open REPL */
   if (argc == 1) {
@@ -1086,6 +5517,7 @@ int main(int argc, char** argv) {
         lval_println(x);
         lval_del(x);
         mpc_ast_delete(r.output);
+        gc_maybe_collect();
       } else {
         /* Failure: Print Error */
         mpc_err_print(r.error);
@@ -1100,7 +5532,7 @@ int main(int argc, char** argv) {
   if (argc >= 2) {
     /* put each filename into a string and load it */
     for (int i = 1; i < argc; i++) {
-      lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
+      lval* args = lval_add(lval_sexpr_sized(1), lval_str(argv[i]));
       lval* x = builtin_load(e, args);
 
       /* if result is an error, print it */
@@ -1110,16 +5542,11 @@ int main(int argc, char** argv) {
     }
   }
 
-
-  lenv_del(e);
-
-  /* Undefine and Delete parsers */
-  mpc_cleanup(8,
-              Number, Symbol, String, Comment,
-              QExpression, SExpression,
-              Expression, Lisb);
+  lisb_cleanup(e);
 
   return 0;
 } /* end main */
 
+#endif
+
 /**************************************************/
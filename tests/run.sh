@@ -0,0 +1,43 @@
+#!/bin/sh
+# usage: tests/run.sh [lisb binary]
+# Runs each tests/*.lisb on the tree walker, with --jit, and
+# as the program --emit-c writes for it, and diffs each
+# against tests/*.expected. The programs are built against
+# lisb.c with -DLISB_NO_MAIN, using $CC and $CFLAGS. The
+# tests run from tests/, so they can load files in it.
+lisb=${1:-./lisb}
+lisb=$(cd "$(dirname "$lisb")" && pwd)/$(basename "$lisb")
+cd "$(dirname "$0")" || exit 1
+cc=${CC:-cc}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+check() {
+  if diff "$exp" "$tmp/out" > "$tmp/diff"; then
+    echo "ok   $t $1"
+  else
+    echo "FAIL $t $1"
+    cat "$tmp/diff"
+    fail=1
+  fi
+}
+
+$cc $CFLAGS -DLISB_NO_MAIN -c ../lisb.c -o "$tmp/lisb.o" &&
+  $cc $CFLAGS -c ../mpc.c -o "$tmp/mpc.o" || exit 1
+
+for t in *.lisb; do
+  exp="${t%.lisb}.expected"
+  for mode in "" --jit; do
+    "$lisb" $mode "$t" > "$tmp/out" 2>&1
+    check "$mode"
+  done
+  if "$lisb" --emit-c "$t" > "$tmp/prog.c" &&
+     $cc $CFLAGS "$tmp/prog.c" "$tmp/lisb.o" "$tmp/mpc.o" -lm -o "$tmp/prog"; then
+    "$tmp/prog" > "$tmp/out" 2>&1
+  else
+    echo "--emit-c failed" > "$tmp/out"
+  fi
+  check --emit-c
+done
+exit $fail